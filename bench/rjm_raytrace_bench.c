@@ -0,0 +1,542 @@
+// rjm_raytrace_bench.c
+//
+// Benchmark for rjm_raytrace.h. Builds a set of procedural scenes of
+// increasing size and measures tree build time and tracing throughput
+// for a few typical workloads. Results are written to stdout as one
+// JSON object per line, so they can be collected and compared between
+// versions of the header.
+//
+// Build with something like:
+//   cc -O2 -std=c99 -I.. rjm_raytrace_bench.c -o rjm_raytrace_bench -lm
+// Add -DRJM_RAYTRACE_STATS to also record traversal counters
+// (this slows tracing down slightly, so don't compare times across the two).
+//
+// Usage:
+//   rjm_raytrace_bench [maxlevel] [scene]
+//     maxlevel - largest scene size to run, 1-4 (default 3)
+//     scene    - only run scenes with this name
+
+
+// This is free and unencumbered software released into the public domain.
+// 
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+// 
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+// 
+// For more information, please refer to <http://unlicense.org/>
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define RJM_RAYTRACE_IMPLEMENTATION
+#include "../rjm_raytrace.h"
+
+#ifdef _WIN32
+#include <windows.h>
+static double benchTime(void)
+{
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+#else
+#include <time.h>
+static double benchTime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#endif
+
+#define BENCH_PI		3.14159265f
+#define BENCH_RES		512		// primary/directional rays per side
+#define BENCH_AO_RES	128		// AO sample points per side
+#define BENCH_AO_RAYS	16		// AO rays per sample point
+#define BENCH_ITERS		3		// best-of count for each workload
+
+//--- Scene construction --------------------------------------------------
+
+typedef struct {
+	const char *name;
+	int nverts, ntris;
+	int maxverts, maxtris;
+	float *vtxs;
+	int *tris;
+	RjmRayFilterFn *filter;
+	float bmin[3], bmax[3];
+} BenchScene;
+
+static unsigned benchSeed = 1;
+
+static float benchRand(void)
+{
+	benchSeed ^= benchSeed << 13;
+	benchSeed ^= benchSeed >> 17;
+	benchSeed ^= benchSeed << 5;
+	return (benchSeed >> 8) * (1.0f / 16777216.0f);
+}
+
+static int benchAddVert(BenchScene *s, float x, float y, float z)
+{
+	if (s->nverts >= s->maxverts) {
+		s->maxverts = s->maxverts ? s->maxverts*2 : 4096;
+		s->vtxs = (float *)realloc(s->vtxs, s->maxverts * 3 * sizeof(float));
+	}
+	float *v = s->vtxs + s->nverts*3;
+	v[0] = x; v[1] = y; v[2] = z;
+	return s->nverts++;
+}
+
+static void benchAddTri(BenchScene *s, int a, int b, int c)
+{
+	if (s->ntris >= s->maxtris) {
+		s->maxtris = s->maxtris ? s->maxtris*2 : 4096;
+		s->tris = (int *)realloc(s->tris, s->maxtris * 3 * sizeof(int));
+	}
+	int *t = s->tris + s->ntris*3;
+	t[0] = a; t[1] = b; t[2] = c;
+	s->ntris++;
+}
+
+static void benchAddSphere(BenchScene *s, const float *c, float r)
+{
+	enum { SEGS = 16, RINGS = 8 };
+	int base = s->nverts;
+	for (int y=0;y<=RINGS;y++)
+	{
+		float theta = BENCH_PI * y / RINGS;
+		for (int x=0;x<SEGS;x++)
+		{
+			float phi = 2 * BENCH_PI * x / SEGS;
+			benchAddVert(s,
+				c[0] + r * sinf(theta) * cosf(phi),
+				c[1] + r * cosf(theta),
+				c[2] + r * sinf(theta) * sinf(phi));
+		}
+	}
+	for (int y=0;y<RINGS;y++)
+	{
+		for (int x=0;x<SEGS;x++)
+		{
+			int a = base + y*SEGS + x;
+			int b = base + y*SEGS + (x+1)%SEGS;
+			benchAddTri(s, a, b, a+SEGS);
+			benchAddTri(s, b, b+SEGS, a+SEGS);
+		}
+	}
+}
+
+static void benchAddFlake(BenchScene *s, const float *c, float r, int depth, int skip)
+{
+	static const float dirs[6][3] = {
+		{ 1,0,0 }, { -1,0,0 }, { 0,1,0 }, { 0,-1,0 }, { 0,0,1 }, { 0,0,-1 }
+	};
+	benchAddSphere(s, c, r);
+	if (depth <= 0)
+		return;
+	for (int n=0;n<6;n++)
+	{
+		if (n == skip)
+			continue;
+		float cr = r / 3;
+		float cc[3];
+		for (int i=0;i<3;i++)
+			cc[i] = c[i] + dirs[n][i] * (r + cr);
+		benchAddFlake(s, cc, cr, depth-1, n^1);
+	}
+}
+
+static float benchHeight(float x, float z)
+{
+	return 0.08f * sinf(x*7.1f) * cosf(z*5.3f)
+		 + 0.03f * sinf(x*23.0f + z*17.0f)
+		 + 0.01f * cosf(x*61.0f - z*53.0f);
+}
+
+// Leaves are quads; cut a rounded shape out of each half.
+static float benchLeafFilter(int triIdx, int rayIdx, float t, float u, float v, void *userdata)
+{
+	(void)triIdx; (void)rayIdx; (void)t; (void)userdata;
+	return (u*u + v*v < 0.6f) ? 1.0f : 0.0f;
+}
+
+static void benchMakeScene(BenchScene *s, const char *name, int level)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	benchSeed = 0x9e3779b9u;
+
+	if (!strcmp(name, "flake"))
+	{
+		float c[3] = { 0, 0, 0 };
+		benchAddFlake(s, c, 1.0f, level, -1);
+	}
+	else if (!strcmp(name, "soup"))
+	{
+		int count = 4096 << (level*2);
+		float size = 0.02f;
+		for (int n=0;n<count;n++)
+		{
+			float c[3] = { benchRand(), benchRand(), benchRand() };
+			int a = benchAddVert(s, c[0], c[1], c[2]);
+			int b = benchAddVert(s, c[0]+(benchRand()-0.5f)*size, c[1]+(benchRand()-0.5f)*size, c[2]+(benchRand()-0.5f)*size);
+			int d = benchAddVert(s, c[0]+(benchRand()-0.5f)*size, c[1]+(benchRand()-0.5f)*size, c[2]+(benchRand()-0.5f)*size);
+			benchAddTri(s, a, b, d);
+		}
+	}
+	else if (!strcmp(name, "terrain"))
+	{
+		int res = 32 << level;
+		for (int z=0;z<=res;z++)
+		{
+			for (int x=0;x<=res;x++)
+			{
+				float fx = (float)x / res, fz = (float)z / res;
+				benchAddVert(s, fx, benchHeight(fx, fz), fz);
+			}
+		}
+		for (int z=0;z<res;z++)
+		{
+			for (int x=0;x<res;x++)
+			{
+				int a = z*(res+1) + x;
+				benchAddTri(s, a, a+res+1, a+1);
+				benchAddTri(s, a+1, a+res+1, a+res+2);
+			}
+		}
+	}
+	else if (!strcmp(name, "foliage"))
+	{
+		int count = 2048 << (level*2);
+		float size = 0.03f;
+		for (int n=0;n<count;n++)
+		{
+			// Random quad, made of two triangles sharing the diagonal.
+			float c[3] = { benchRand(), benchRand(), benchRand() };
+			float e0[3], e1[3];
+			for (int i=0;i<3;i++) {
+				e0[i] = (benchRand()-0.5f) * size;
+				e1[i] = (benchRand()-0.5f) * size;
+			}
+			int a = benchAddVert(s, c[0], c[1], c[2]);
+			int b = benchAddVert(s, c[0]+e0[0], c[1]+e0[1], c[2]+e0[2]);
+			int d = benchAddVert(s, c[0]+e1[0], c[1]+e1[1], c[2]+e1[2]);
+			int e = benchAddVert(s, c[0]+e0[0]+e1[0], c[1]+e0[1]+e1[1], c[2]+e0[2]+e1[2]);
+			benchAddTri(s, a, b, d);
+			benchAddTri(s, e, d, b);
+		}
+		s->filter = benchLeafFilter;
+	}
+
+	for (int i=0;i<3;i++) {
+		s->bmin[i] = FLT_MAX;
+		s->bmax[i] = -FLT_MAX;
+	}
+	for (int n=0;n<s->nverts;n++)
+	{
+		for (int i=0;i<3;i++) {
+			float f = s->vtxs[n*3+i];
+			if (f < s->bmin[i]) s->bmin[i] = f;
+			if (f > s->bmax[i]) s->bmax[i] = f;
+		}
+	}
+}
+
+static void benchFreeScene(BenchScene *s)
+{
+	free(s->vtxs);
+	free(s->tris);
+}
+
+//--- Workloads -----------------------------------------------------------
+
+static void benchNormalize(float *v)
+{
+	float len = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+	float s = (len > 0) ? 1.0f/len : 0;
+	v[0] *= s; v[1] *= s; v[2] *= s;
+}
+
+static void benchCross(float *o, const float *a, const float *b)
+{
+	o[0] = a[1]*b[2] - a[2]*b[1];
+	o[1] = a[2]*b[0] - a[0]*b[2];
+	o[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+static float benchDiag(const BenchScene *s)
+{
+	float dx = s->bmax[0]-s->bmin[0], dy = s->bmax[1]-s->bmin[1], dz = s->bmax[2]-s->bmin[2];
+	return sqrtf(dx*dx + dy*dy + dz*dz);
+}
+
+// Pinhole camera looking at the scene from above one corner.
+static int benchPrimaryRays(const BenchScene *s, RjmRay *rays)
+{
+	float diag = benchDiag(s);
+	float target[3], eye[3], fwd[3], right[3], up[3];
+	float worldUp[3] = { 0, 1, 0 };
+	for (int i=0;i<3;i++)
+		target[i] = (s->bmin[i] + s->bmax[i]) * 0.5f;
+	eye[0] = target[0] + diag * 0.6f;
+	eye[1] = target[1] + diag * 0.5f;
+	eye[2] = target[2] + diag * 0.7f;
+	for (int i=0;i<3;i++)
+		fwd[i] = target[i] - eye[i];
+	benchNormalize(fwd);
+	benchCross(right, fwd, worldUp);
+	benchNormalize(right);
+	benchCross(up, right, fwd);
+
+	int n = 0;
+	for (int y=0;y<BENCH_RES;y++)
+	{
+		for (int x=0;x<BENCH_RES;x++,n++)
+		{
+			float px = (x + 0.5f) / BENCH_RES * 2 - 1;
+			float py = 1 - (y + 0.5f) / BENCH_RES * 2;
+			RjmRay *ray = rays + n;
+			for (int i=0;i<3;i++) {
+				ray->org[i] = eye[i];
+				ray->dir[i] = fwd[i] + (px*right[i] + py*up[i]) * 0.6f;
+			}
+			ray->t = FLT_MAX;
+		}
+	}
+	return n;
+}
+
+// Incoherent rays with random origins and directions inside the scene.
+static int benchRandomRays(const BenchScene *s, RjmRay *rays)
+{
+	int n = BENCH_RES*BENCH_RES;
+	benchSeed = 0x1234567u;
+	for (int i=0;i<n;i++)
+	{
+		RjmRay *ray = rays + i;
+		for (int k=0;k<3;k++) {
+			ray->org[k] = s->bmin[k] + (s->bmax[k]-s->bmin[k]) * benchRand();
+			ray->dir[k] = benchRand()*2 - 1;
+		}
+		ray->t = FLT_MAX;
+	}
+	return n;
+}
+
+// Gets the surface point and facing normal for a primary hit.
+static void benchHitPoint(const BenchScene *s, const RjmRay *ray, float *pos, float *nrm)
+{
+	const int *tri = s->tris + ray->hit*3;
+	const float *v0 = s->vtxs + tri[0]*3;
+	const float *v1 = s->vtxs + tri[1]*3;
+	const float *v2 = s->vtxs + tri[2]*3;
+	float e0[3], e1[3];
+	for (int i=0;i<3;i++) {
+		e0[i] = v1[i] - v0[i];
+		e1[i] = v2[i] - v0[i];
+	}
+	benchCross(nrm, e0, e1);
+	benchNormalize(nrm);
+	if (nrm[0]*ray->dir[0] + nrm[1]*ray->dir[1] + nrm[2]*ray->dir[2] > 0) {
+		nrm[0] = -nrm[0]; nrm[1] = -nrm[1]; nrm[2] = -nrm[2];
+	}
+	float eps = benchDiag(s) * 1e-4f;
+	for (int i=0;i<3;i++)
+		pos[i] = ray->org[i] + ray->dir[i] * ray->t + nrm[i] * eps;
+}
+
+// Shadow rays towards a fixed directional light, from each primary hit.
+static int benchDirectionalRays(const BenchScene *s, const RjmRay *primary, int nprimary, RjmRay *rays)
+{
+	float light[3] = { 0.3f, 1.0f, 0.2f };
+	benchNormalize(light);
+	int n = 0;
+	for (int i=0;i<nprimary;i++)
+	{
+		if (primary[i].hit < 0)
+			continue;
+		float nrm[3];
+		RjmRay *ray = rays + n++;
+		benchHitPoint(s, primary + i, ray->org, nrm);
+		for (int k=0;k<3;k++)
+			ray->dir[k] = light[k];
+		ray->t = FLT_MAX;
+	}
+	return n;
+}
+
+// Cosine-ish hemisphere rays around the normal of a subset of primary hits.
+static int benchAORays(const BenchScene *s, const RjmRay *primary, RjmRay *rays)
+{
+	int step = BENCH_RES / BENCH_AO_RES;
+	float range = benchDiag(s) * 0.1f;
+	int n = 0;
+	benchSeed = 0x7654321u;
+	for (int y=0;y<BENCH_RES;y+=step)
+	{
+		for (int x=0;x<BENCH_RES;x+=step)
+		{
+			const RjmRay *src = primary + y*BENCH_RES + x;
+			if (src->hit < 0)
+				continue;
+			float pos[3], nrm[3];
+			benchHitPoint(s, src, pos, nrm);
+			for (int r=0;r<BENCH_AO_RAYS;r++)
+			{
+				float d[3];
+				do {
+					d[0] = benchRand()*2 - 1;
+					d[1] = benchRand()*2 - 1;
+					d[2] = benchRand()*2 - 1;
+				} while (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] > 1);
+				RjmRay *ray = rays + n++;
+				for (int k=0;k<3;k++) {
+					ray->org[k] = pos[k];
+					ray->dir[k] = d[k] + nrm[k];
+				}
+				ray->t = range;
+			}
+		}
+	}
+	return n;
+}
+
+//--- Driver --------------------------------------------------------------
+
+static void benchReport(const BenchScene *s, int level, const char *workload,
+	RjmRayTree *tree, RjmRay *rays, int nrays, float cutoff)
+{
+	// Rays get modified by tracing, so keep a pristine copy.
+	RjmRay *copy = (RjmRay *)malloc(nrays * sizeof(RjmRay));
+	double best = 0;
+	int nhit = 0;
+	for (int it=0;it<BENCH_ITERS;it++)
+	{
+		memcpy(copy, rays, nrays * sizeof(RjmRay));
+		double t0 = benchTime();
+		rjm_raytrace(tree, nrays, copy, cutoff, s->filter, NULL);
+		double t1 = benchTime();
+		if (it == 0 || t1-t0 < best)
+			best = t1-t0;
+	}
+	for (int n=0;n<nrays;n++)
+		nhit += (cutoff >= 0) ? (copy[n].visibility <= cutoff) : (copy[n].hit >= 0);
+
+	printf("{\"scene\":\"%s\",\"level\":%d,\"workload\":\"%s\",\"rays\":%d,\"hits\":%d,"
+		"\"seconds\":%.6f,\"mrays_per_s\":%.3f",
+		s->name, level, workload, nrays, nhit, best, best > 0 ? nrays / best * 1e-6 : 0.0);
+
+#ifdef RJM_RAYTRACE_STATS
+	// Counters from the last (identical) iteration.
+	RjmRayStats st;
+	rjm_raytracestats(&st);
+	double rcount = st.rays ? (double)st.rays : 1.0;
+	printf(",\"nodes_per_packet\":%.3f,\"slab_tests_per_ray\":%.3f,\"tri_tests_per_ray\":%.3f,"
+		"\"filter_calls\":%lld,\"leaf_fill\":%.3f,\"packet_occupancy\":%.3f",
+		st.packets ? (st.nodes + st.leafs) / (double)st.packets : 0.0,
+		st.slabTests / rcount,
+		st.triTests / rcount,
+		st.filterCalls,
+		st.leafs ? st.leafTris / ((double)st.leafs * RJM_MAX_RAYTREE_LEAF_TRIS) : 0.0,
+		st.packets ? st.rays / ((double)st.packets * RJM_PACKET_SIZE) : 0.0);
+#endif
+	printf("}\n");
+	fflush(stdout);
+
+	// Hand the results back to the caller for chaining workloads.
+	memcpy(rays, copy, nrays * sizeof(RjmRay));
+	free(copy);
+}
+
+static void benchRun(const char *name, int level)
+{
+	BenchScene s;
+	benchMakeScene(&s, name, level);
+
+	RjmRayTree tree;
+	memset(&tree, 0, sizeof(tree));
+	tree.triCount = s.ntris;
+	tree.vtxs = s.vtxs;
+	tree.tris = s.tris;
+
+	double t0 = benchTime();
+	rjm_buildraytree(&tree);
+	double t1 = benchTime();
+
+	RjmRayTreeInfo info;
+	rjm_raytreeinfo(&tree, &info);
+	size_t sceneBytes = s.nverts * 3 * sizeof(float) + s.ntris * 3 * sizeof(int);
+
+	printf("{\"scene\":\"%s\",\"level\":%d,\"workload\":\"build\",\"tris\":%d,\"verts\":%d,"
+		"\"build_seconds\":%.6f,\"tree_bytes\":%zu,\"scene_bytes\":%zu,"
+		"\"nodes\":%d,\"leafs\":%d,\"depth\":%d,\"sah_cost\":%.3f,\"leaf_fill\":[",
+		s.name, level, s.ntris, s.nverts, t1-t0, info.totalBytes, sceneBytes,
+		info.nodeCount, info.leafCount, info.depth, info.sahCost);
+	for (int n=0;n<=RJM_MAX_RAYTREE_LEAF_TRIS;n++)
+		printf("%s%d", n ? "," : "", info.leafFill[n]);
+	printf("]}\n");
+	fflush(stdout);
+
+	int maxrays = BENCH_RES*BENCH_RES;
+	if (maxrays < BENCH_AO_RES*BENCH_AO_RES*BENCH_AO_RAYS)
+		maxrays = BENCH_AO_RES*BENCH_AO_RES*BENCH_AO_RAYS;
+	RjmRay *primary = (RjmRay *)malloc(maxrays * sizeof(RjmRay));
+	RjmRay *rays = (RjmRay *)malloc(maxrays * sizeof(RjmRay));
+
+	int nprimary = benchPrimaryRays(&s, primary);
+	benchReport(&s, level, "primary", &tree, primary, nprimary, RJM_RAYTRACE_FIRSTHIT);
+
+	int n = benchAORays(&s, primary, rays);
+	benchReport(&s, level, "ao", &tree, rays, n, 0.0f);
+
+	n = benchDirectionalRays(&s, primary, nprimary, rays);
+	benchReport(&s, level, "directional", &tree, rays, n, 0.0f);
+
+	n = benchRandomRays(&s, rays);
+	benchReport(&s, level, "firsthit", &tree, rays, n, RJM_RAYTRACE_FIRSTHIT);
+
+	free(primary);
+	free(rays);
+	rjm_freeraytree(&tree);
+	benchFreeScene(&s);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *scenes[] = { "flake", "soup", "terrain", "foliage" };
+	int maxlevel = (argc > 1) ? atoi(argv[1]) : 3;
+	const char *only = (argc > 2) ? argv[2] : NULL;
+
+	for (int level=1;level<=maxlevel;level++)
+	{
+		for (int n=0;n<(int)(sizeof(scenes)/sizeof(scenes[0]));n++)
+		{
+			if (only && strcmp(only, scenes[n]))
+				continue;
+			benchRun(scenes[n], level);
+		}
+	}
+	return 0;
+}
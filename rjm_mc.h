@@ -4,6 +4,8 @@
 // To generate the implementation, place this define in exactly one source
 // file before including the header:
 // #define MC_IMPLEMENTATION
+// C++ files that use mcGenerateT also need this, before including it:
+// #define MC_TEMPLATE
 
 //--- Licence -------------------------------------------------------------
 // This is free and unencumbered software released into the public domain.
@@ -85,6 +87,28 @@
 #define MC_REALLOC	realloc
 #endif
 
+// Set to 0 to build without threading support, in which case
+// mcGenerateParallel just runs on the calling thread.
+#ifndef MC_THREADS
+#define MC_THREADS	1
+#endif
+
+// Most threads mcGenerateParallel will use.
+#ifndef MC_MAX_THREADS
+#define MC_MAX_THREADS	64
+#endif
+
+// Cells along each side of the blocks a McContext remakes.
+#ifndef MC_CONTEXT_BLOCK
+#define MC_CONTEXT_BLOCK	16
+#endif
+
+// Tweak for the most points to pass to a McIsoBatchFn at once.
+// (rows of the grid are never split, so it can be more than this)
+#ifndef MC_BATCH_SIZE
+#define MC_BATCH_SIZE	4096
+#endif
+
 typedef struct {
 	float x, y, z;
 	float nx, ny, nz;
@@ -98,6 +122,23 @@ typedef struct {
 // fill in "extra" with any additional data channels required.
 typedef float McIsoFn(const float *pos, float *extra, void *userparam);
 
+// Batched version of McIsoFn, for fields that are faster to evaluate
+// many points at a time (e.g. with SIMD).
+// Given 'count' positions as separate x/y/z arrays, you should fill in
+// values[0..count-1], and extra[c*count + i] for each extra channel c.
+typedef void McIsoBatchFn(int count, const float *x, const float *y, const float *z, float *values, float *extra, void *userparam);
+
+// Version of McIsoFn that also gives the field gradient, for fields that
+// know it analytically (e.g. SDF primitives). Fill in grad (a vector3)
+// as well as the value; it doesn't need to be normalized.
+typedef float McIsoGradFn(const float *pos, float *grad, float *extra, void *userparam);
+
+// Bounds the field over a box, e.g. with interval arithmetic, so empty or
+// solid space can be skipped. Set lo/hi so that every value inside
+// bmin..bmax (inclusive) lies between them. Loose bounds are fine, but
+// wrong ones will lose parts of the surface.
+typedef void McIsoBoundFn(const float *bmin, const float *bmax, float *lo, float *hi, void *userparam);
+
 // Mesh returned by the algorithm.
 // Free the data yourself (or call mcFree).
 typedef struct {
@@ -117,6 +158,183 @@ extern "C" {
 // userparam   - any data you want to pass to your function.
 McMesh mcGenerate(const float *bmin, const float *bmax, float cellsize, McIsoFn *fn, void *userparam);
 
+// Same as mcGenerate, but splits the volume into slabs along Z and
+// triangulates them on several threads. Your function must be safe to
+// call from multiple threads at once.
+// The vertices where slabs meet are shared, so you get the same mesh
+// as mcGenerate (just with the vertices in a different order).
+// nthreads    - number of threads to use, or 0 for one per CPU.
+McMesh mcGenerateParallel(const float *bmin, const float *bmax, float cellsize, McIsoFn *fn, void *userparam, int nthreads);
+
+// How McConfig gets the vertex normals.
+#define MC_NORMALS_FIELD	0	// sample the field around each vertex (4 calls per vertex)
+#define MC_NORMALS_GRID		1	// central differences of the cell corners (no extra calls)
+
+// Options for mcGenerateEx. Zero it, then fill in the parts you need.
+typedef struct {
+	McIsoFn *fn;				// your field function...
+	McIsoBatchFn *batchFn;		// ...or a batched one (used instead if set)
+	void *userparam;			// any data you want to pass to your function
+	int threads;				// threads to use (0/1 = calling thread only, -1 = one per CPU)
+	int normals;				// one of the MC_NORMALS_ modes above
+	McIsoGradFn *gradFn;		// if set, normals come from one call to this at each vertex
+								// (and it samples the corners too, if fn/batchFn aren't set)
+
+	// Optional empty-space skipping. If either is set, blocks of cells
+	// that can't contain the surface aren't sampled at all. (the mesh is
+	// the same as without, as long as the bounds are right)
+	McIsoBoundFn *boundFn;		// bounds the field over a box...
+	float lipschitz;			// ...or, a limit on how fast it can change with distance
+								// (e.g. 1 for an exact SDF), and it's bounded from the centre
+
+	int exact;					// if set, count the mesh first and then make it straight
+								// into arrays of exactly the right size (samples the field
+								// twice, so best for cheap fields)
+} McConfig;
+
+// Same as mcGenerate, but with all the options available.
+McMesh mcGenerateEx(const float *bmin, const float *bmax, float cellsize, const McConfig *config);
+
+// Counts the vertices and triangles mcGenerateEx would make, without
+// making them. Returns 0 if out of memory.
+int mcCountEx(const float *bmin, const float *bmax, float cellsize, const McConfig *config, int *nverts, int *ntris);
+
+// Same as mcGenerateEx, but makes the mesh in your own arrays.
+// Set mesh->verts and mesh->indices to them, and mesh->nverts and
+// mesh->ntris to how many they hold; these become the counts used.
+// Returns 0 (with the counts it needed) if they're too small, or if
+// out of memory. Don't mcFree the mesh.
+int mcGenerateInto(const float *bmin, const float *bmax, float cellsize, const McConfig *config, McMesh *mesh);
+
+// Sample types for McVolume.
+#define MC_VOLUME_FLOAT		0
+#define MC_VOLUME_UINT8		1
+#define MC_VOLUME_UINT16	2
+
+// A dense 3D array of field values, for mcGenerateFromGrid.
+typedef struct {
+	const void *data;		// the first sample
+	int type;				// one of the MC_VOLUME_ types above
+	int size[3];			// number of samples along each axis
+	int stride[3];			// distance between samples along each axis, in samples
+	float origin[3];		// position of the first sample
+	float spacing[3];		// distance between samples along each axis
+	float iso;				// value of the surface (values below are inside)
+} McVolume;
+
+// Triangulates an isosurface from a volume you've already sampled,
+// e.g. simulation output or a voxelized SDF. Each sample becomes a cell
+// corner, and normals come from central differences on the grid.
+// threads     - as for McConfig.
+McMesh mcGenerateFromGrid(const McVolume *volume, int threads);
+
+// Same as mcGenerateFromGrid, but for a raw volume file too big to load.
+// The file is memory-mapped and read a slice at a time, so only a few
+// slices per thread are ever resident. (the paging hints need madvise,
+// which glibc hides under strict -std=c99 unless you define _DEFAULT_SOURCE)
+// path        - file holding the samples, packed X first, in native byte order.
+// offset      - bytes to skip at the start of the file (e.g. a header).
+// layout      - describes the samples. (data and stride are ignored)
+// Returns an empty mesh if the file can't be mapped or is too small.
+McMesh mcGenerateFromFile(const char *path, size_t offset, const McVolume *layout, int threads);
+
+// Receives a mesh a piece at a time, as it's made. Vertices are numbered
+// on from the ones in earlier pieces, and triangles can use those too.
+// Copy out what you need; the arrays are reused for the next piece.
+// Return 0 to carry on, or anything else to stop.
+typedef int McStreamFn(const McVertex *verts, int nverts, const int *indices, int ntris, void *userparam);
+
+// Same as mcGenerateEx, mcGenerateFromGrid and mcGenerateFromFile, but
+// rather than building the whole mesh in memory, they pass it to stream
+// after each layer of cells, so only the vertices of one layer and the
+// edges of two slices are held at once. They run on the calling thread.
+// Return 1 when done, or 0 if out of memory or stream stopped them.
+int mcStreamEx(const float *bmin, const float *bmax, float cellsize, const McConfig *config, McStreamFn *stream, void *streamparam);
+int mcStreamFromGrid(const McVolume *volume, McStreamFn *stream, void *streamparam);
+int mcStreamFromFile(const char *path, size_t offset, const McVolume *layout, McStreamFn *stream, void *streamparam);
+
+// Decides whether a cell of an adaptive grid is worth splitting, e.g. by
+// its distance from the viewer, or an error metric of your own.
+// Only asked about cells the surface might pass through.
+typedef int McRefineFn(const float *bmin, const float *bmax, void *userparam);
+
+// Triangulates an isosurface on an adaptive grid. Cells start out 2^levels
+// times bigger than cellsize, and are split in half (down to cellsize)
+// wherever refine asks for it and the surface might be in them. (i.e. their
+// corners differ in sign, or config's bounds say so if it has them)
+// Neighbouring cells are kept within one size of each other, and the joins
+// between sizes are stitched, so the mesh has no cracks.
+// config      - field callbacks, as for mcGenerateEx. Normals are sampled
+//               around each vertex (or come from gradFn), and so is extra data.
+//               (the threads and normals options are ignored)
+// refine      - also gets config->userparam.
+McMesh mcGenerateAdaptive(const float *bmin, const float *bmax, float cellsize, int levels, McRefineFn *refine, const McConfig *config);
+
+// Faces of a chunk, for McChunk.
+#define MC_FACE_NEG_X		1
+#define MC_FACE_POS_X		2
+#define MC_FACE_NEG_Y		4
+#define MC_FACE_POS_Y		8
+#define MC_FACE_NEG_Z		16
+#define MC_FACE_POS_Z		32
+
+// One chunk of a world split into cubes of cells, at some level of detail,
+// for mcGenerateChunk. Face f (0-5, in the order of the MC_FACE_ bits)
+// has (cells+1)^2 samples, in rows along axis (f/2+2)%3, each row
+// running along axis (f/2+1)%3, so both sides of a face agree.
+typedef struct {
+	int coord[3];				// which chunk, counting in chunks of this size from the origin
+	int lod;					// level of detail (cells are 2^lod times the finest size)
+	int coarser;				// MC_FACE_ bits for faces whose neighbour is one level coarser
+	const float *border[6];		// optional field values for each face, e.g. saved from a
+								// neighbour at the same level, so they aren't sampled again
+	float *borderOut[6];		// if set, receives this chunk's values for each face
+} McChunk;
+
+// Triangulates one chunk of a world, so that chunks at neighbouring
+// levels of detail join without cracks. On faces marked as coarser, the
+// samples are made to match the coarser neighbour, and the gap left
+// between its edges and ours is filled in on our side.
+// origin      - position of the world's first corner. (vector3)
+// cellsize    - width of the finest cells.
+// cells       - number of cells along each side of a chunk. (even, if any
+//               faces are coarser)
+// config      - as for mcGenerateEx. The chunk is sampled first and made from
+//               the samples, so fn, batchFn or gradFn is called once per corner
+//               and the bounds are only used to skip empty chunks. Grid normals
+//               are sampled from the field on the chunk's faces, so they match
+//               the neighbours'.
+McMesh mcGenerateChunk(const float *origin, float cellsize, int cells, const McChunk *chunk, const McConfig *config);
+
+// A mesh you can update after changing the field, by only remaking
+// the parts of it that changed. It's kept in blocks of MC_CONTEXT_BLOCK
+// cells along each side, each with its own vertices, so you can upload
+// just the blocks that change.
+typedef struct McContext McContext;
+
+// Samples the field over the bounds and makes the mesh, keeping
+// the samples for later updates.
+// config      - as for mcGenerateEx. (threads and bounds aren't used)
+// Returns NULL if out of memory.
+McContext *mcCreateContext(const float *bmin, const float *bmax, float cellsize, const McConfig *config);
+
+// Re-samples the field at the corners within a box you've changed, and
+// remakes the blocks whose cells (or normals) see a different value.
+// changed     - if set, gets the blocks that were remade. (valid until
+//               the next update)
+// Returns how many blocks were remade.
+int mcUpdateContext(McContext *ctx, const float *bmin, const float *bmax, const int **changed);
+
+// The number of blocks, and the mesh of each, numbered X first.
+int mcContextBlocks(const McContext *ctx);
+const McMesh *mcContextBlock(const McContext *ctx, int block);
+
+// Joins all the blocks up into one mesh, for you to free.
+// (vertices on the edges of blocks are repeated)
+McMesh mcContextMesh(const McContext *ctx);
+
+void mcFreeContext(McContext *ctx);
+
 // Frees mesh data (or do it yourself if you like).
 void mcFree(McMesh *mesh);
 
@@ -124,20 +342,113 @@ void mcFree(McMesh *mesh);
 }
 #endif
 
+#if defined(__cplusplus) && (defined(MC_TEMPLATE) || defined(MC_IMPLEMENTATION))
+// C++ version of mcGenerate, taking your field as a functor (or lambda)
+// instead of a function pointer, so it can be inlined into the loops
+// that sample it. The mesh is the same as the C version gives you.
+// It's compiled into each file that uses it, so define MC_TEMPLATE
+// before including the header there. (MC_IMPLEMENTATION is still
+// needed in one file, as usual)
+// fn          - callable as: float fn(const float *pos, float *extra)
+// threads     - as for McConfig. (fn must be thread-safe if not 1)
+template<class Fn>
+static inline McMesh mcGenerateT(const float *bmin, const float *bmax, float cellsize, Fn fn, int threads = 1);
+#endif
+
 
 //--- Implementation follows ----------------------------------------------
 
-#ifdef MC_IMPLEMENTATION
+// The marching code is also needed by the C++ template, which gets
+// instantiated in whichever file uses it.
+#if defined(MC_IMPLEMENTATION) || (defined(__cplusplus) && defined(MC_TEMPLATE))
 
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MC_SSE 1
+#else
+#define MC_SSE 0
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static __inline int mcLowestBit(uint32_t x) { unsigned long n; _BitScanForward(&n, x); return (int)n; }
+static __inline int mcBitCount(uint32_t x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (int)((((x + (x >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24);
+}
+#else
+#define mcLowestBit(x)	__builtin_ctz(x)
+#define mcBitCount(x)	__builtin_popcount(x)
+#endif
 
+// Slabs to split the volume into for each thread, and the fewest slices
+// worth giving a slab. (each slab has to read one extra slice)
+#define MC_SLABS_PER_THREAD		4
+#define MC_MIN_SLAB_SLICES		16
+
+// Size of the blocks of cells that empty-space skipping
+// bounds the field over.
+#define MC_BLOCK_SIZE			8
+
+// Shared helpers are inline in C++, so that files which
+// don't use them don't get warnings.
+#ifdef __cplusplus
+#define MC_STATIC	static inline
+#else
+#define MC_STATIC	static
+#endif
+
+// The parts that need the OS headers live with the implementation,
+// so files using the template don't have to include them.
+#ifdef __cplusplus
+extern "C" {
+#endif
+int mcDefaultThreads(void);
+void mcRunThreads(void (*fn)(void *), void *items, size_t itemSize, int count);
+void mcVolumeHint(const McVolume *vol, int z0, int z1, int willNeed);
+#ifdef __cplusplus
+}
+#endif
+
+// Frees memory from MC_REALLOC. (realloc(NULL, 0) is allowed to
+// allocate, so NULL pointers are left alone)
+MC_STATIC void mcFreePtr(void *ptr)
+{
+	if (ptr)
+		MC_REALLOC(ptr, 0);
+}
+
+// A slice of the grid's corners, as separate arrays. Positions aren't
+// stored, as they follow from a corner's indices.
 typedef struct {
-	float x, y, z;
+	float *values;		// field value at each corner (NULL for volumes)
+	uint32_t *signs;	// sign bit of each corner, MC_ROW_WORDS per row
+	int *vtx[2];		// vertex on the x/y edge out of each corner, or -1
+#if MC_EXTRA_DATA > 0
+	float *extra;		// channel i of corner n is at extra[i*count + n]
+#endif
+	int z;
+
+	// Volumes aren't copied into the slice. Their values are read
+	// from the samples when needed, with corner 0,0 at sample vbase.
+	const McVolume *vol;
+	ptrdiff_t vbase;
+} McSlice;
+
+MC_STATIC int mcSignBit(float value)
+{
 	union { float value; unsigned sign; } u;
-	int vtx[3];
-} McCorner;
+	u.value = value;
+	return (int)(u.sign >> 31);
+}
 
-static short mcEdgeTable[256]= {
+static const short mcEdgeTable[256]= {
 	0x000, 0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c,
 	0x80c, 0x905, 0xa0f, 0xb06, 0xc0a, 0xd03, 0xe09, 0xf00,
 	0x190, 0x099, 0x393, 0x29a, 0x596, 0x49f, 0x795, 0x69c,
@@ -172,7 +483,7 @@ static short mcEdgeTable[256]= {
 	0x70c, 0x605, 0x50f, 0x406, 0x30a, 0x203, 0x109, 0x000
 };
 
-static char mcTriTable[256][16] = {
+static const char mcTriTable[256][16] = {
 { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
 { 0, 8, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
 { 0, 1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
@@ -434,67 +745,162 @@ static char mcTriTable[256][16] = {
 typedef struct {
 	McMesh mesh;
 	int maxverts, maxtris;
+	int base;		// vertices already streamed out, which mesh.verts[0] follows
+	int fixed;		// mesh is part of someone else's arrays, sized exactly, so never grow it
 
-	McCorner *c[8];
-	float cellsize;
+	// The slices either side of the layer being marched, and the vertex
+	// on the z edge out of each corner of the bottom one. (or -1)
+	McSlice *bottom, *top;
+	int *zvtx;
+	float bmin[3];
+	float cellsize[3];
+
+	// For grid normals, the slices from the one below the layer being
+	// marched to the one above it. (slices[1] is NULL if not wanted)
+	McSlice *slices[4];
+	int xd, yd;
 } McHelper;
 
-static int mcInterp(McHelper *help, McCorner *a, McCorner *b, int axis)
+MC_STATIC void mcSetNormal(McVertex *v, float nx, float ny, float nz)
+{
+	// Normalize it.
+	float len = sqrtf(nx*nx + ny*ny + nz*nz);
+	float s = (len >= 0.00000000000001f) ? 1.0f/len : 0;
+	v->nx = nx * s;
+	v->ny = ny * s;
+	v->nz = nz * s;
+}
+
+MC_STATIC size_t mcVolumeSampleBytes(int type)
+{
+	return type == MC_VOLUME_UINT8 ? 1 : type == MC_VOLUME_UINT16 ? 2 : 4;
+}
+
+// Reads a volume sample by its index.
+MC_STATIC float mcVolumeAt(const McVolume *vol, ptrdiff_t i)
+{
+	switch (vol->type)
+	{
+	case MC_VOLUME_UINT8:	return ((const uint8_t *)vol->data)[i];
+	case MC_VOLUME_UINT16:	return ((const uint16_t *)vol->data)[i];
+	default:				return ((const float *)vol->data)[i];
+	}
+}
+
+// Gets the value at corner x,y of a slice.
+MC_STATIC float mcSliceValue(const McHelper *help, const McSlice *slice, int x, int y)
+{
+	const McVolume *vol = slice->vol;
+	if (!vol)
+		return slice->values[y*(help->xd+1) + x];
+	return mcVolumeAt(vol, slice->vbase + (ptrdiff_t)x*vol->stride[0] + (ptrdiff_t)y*vol->stride[1]) - vol->iso;
+}
+
+// Gets the field gradient at a corner from its neighbours, by
+// central differences. (clamping to the edges of the grid)
+MC_STATIC void mcCornerGradient(const McHelper *help, const McSlice *slice, int x, int y, float *grad)
+{
+	int stride = help->xd+1;
+	int s = slice == help->slices[2] ? 2 : 1;
+	const float *values = slice->values;
+	int idx = y*stride + x;
+	int x0 = x > 0 ? idx-1 : idx, x1 = x < help->xd ? idx+1 : idx;
+	int y0 = y > 0 ? idx-stride : idx, y1 = y < help->yd ? idx+stride : idx;
+	grad[0] = (values[x1] - values[x0]) / help->cellsize[0];
+	grad[1] = (values[y1] - values[y0]) / help->cellsize[1];
+	grad[2] = (help->slices[s+1]->values[idx] - help->slices[s-1]->values[idx]) / help->cellsize[2];
+}
+
+// Makes the vertex on the edge out of corner x,y of slice along axis.
+// (z edges go up to help->top)
+MC_STATIC int mcInterp(McHelper *help, McSlice *slice, int x, int y, int axis)
 {
 	// Re-use existing vertex if there is one.
-	if (a->vtx[axis] >= 0)
-		return a->vtx[axis];
+	int stride = help->xd+1;
+	int a = y*stride + x;
+	int *slot = axis == 2 ? &help->zvtx[a] : &slice->vtx[axis][a];
+	if (*slot >= 0)
+		return *slot;
 
 	// Allocate more space if needed.
 	int vtxidx = help->mesh.nverts++;
 	if (vtxidx >= help->maxverts) {
+		if (help->fixed) {
+			help->mesh.verts = NULL;
+			return 0;
+		}
 		help->maxverts = help->maxverts ? help->maxverts * 2 : 4096;
 		help->mesh.verts = (McVertex *)MC_REALLOC(help->mesh.verts, help->maxverts*sizeof(McVertex));
 		if (help->mesh.verts == NULL)
 			return 0;
 	}
 
+	// The other end of the edge.
+	const McSlice *other = axis == 2 ? help->top : slice;
+	int bx = x + (axis == 0), by = y + (axis == 1);
+
 	// Get field intersection.
-	float w = a->u.value - b->u.value;
+	float va = mcSliceValue(help, slice, x, y);
+	float vb = mcSliceValue(help, other, bx, by);
+	float w = va - vb;
 	float t = 0;
 	if (fabsf(w) > 0.000001f)
-		t = a->u.value / w;
+		t = va / w;
 
 	// Write out a vertex. (do normals later)
 	McVertex *v = &help->mesh.verts[vtxidx];
 	float *pos = &v->x;
-	pos[0] = a->x;
-	pos[1] = a->y;
-	pos[2] = a->z;
-	pos[axis] += t * help->cellsize;
+	pos[0] = help->bmin[0] + help->cellsize[0]*x;
+	pos[1] = help->bmin[1] + help->cellsize[1]*y;
+	pos[2] = help->bmin[2] + help->cellsize[2]*slice->z;
+	pos[axis] += t * help->cellsize[axis];
 
-	a->vtx[axis] = vtxidx;
-	return vtxidx;
+#if MC_EXTRA_DATA > 0
+	int count = stride*(help->yd+1), b = by*stride + bx;
+	for (int i=0;i<MC_EXTRA_DATA;i++)
+	{
+		float ea = slice->extra[i*count + a], eb = other->extra[i*count + b];
+		v->extra[i] = ea + (eb - ea) * t;
+	}
+#endif
+
+	// Blend the gradients at either end of the edge.
+	if (help->slices[1])
+	{
+		float ga[3], gb[3];
+		mcCornerGradient(help, slice, x, y, ga);
+		mcCornerGradient(help, other, bx, by, gb);
+		mcSetNormal(v, ga[0] + (gb[0]-ga[0])*t, ga[1] + (gb[1]-ga[1])*t, ga[2] + (gb[2]-ga[2])*t);
+	}
+
+	*slot = help->base + vtxidx;
+	return help->base + vtxidx;
 }
 
-static int mcGenerateCell(McHelper *help, int corners, int edges)
+MC_STATIC int mcGenerateCell(McHelper *help, int x, int y, int corners, int edges)
 {
 	// Generate a vertex for every intersecting edge.
+	McSlice *bottom = help->bottom, *top = help->top;
 	int verts[12];
-	if (edges &    1) verts[0]  = mcInterp(help, help->c[0], help->c[1], 0);
-	if (edges &    2) verts[1]  = mcInterp(help, help->c[1], help->c[2], 1);
-	if (edges &    4) verts[2]  = mcInterp(help, help->c[3], help->c[2], 0);
-	if (edges &    8) verts[3]  = mcInterp(help, help->c[0], help->c[3], 1);
-	if (edges &   16) verts[4]  = mcInterp(help, help->c[4], help->c[5], 0);
-	if (edges &   32) verts[5]  = mcInterp(help, help->c[5], help->c[6], 1);
-	if (edges &   64) verts[6]  = mcInterp(help, help->c[7], help->c[6], 0);
-	if (edges &  128) verts[7]  = mcInterp(help, help->c[4], help->c[7], 1);
-	if (edges &  256) verts[8]  = mcInterp(help, help->c[0], help->c[4], 2);
-	if (edges &  512) verts[9]  = mcInterp(help, help->c[1], help->c[5], 2);
-	if (edges & 1024) verts[10] = mcInterp(help, help->c[2], help->c[6], 2);
-	if (edges & 2048) verts[11] = mcInterp(help, help->c[3], help->c[7], 2);
+	if (edges &    1) verts[0]  = mcInterp(help, bottom, x,   y,   0);
+	if (edges &    2) verts[1]  = mcInterp(help, bottom, x+1, y,   1);
+	if (edges &    4) verts[2]  = mcInterp(help, bottom, x,   y+1, 0);
+	if (edges &    8) verts[3]  = mcInterp(help, bottom, x,   y,   1);
+	if (edges &   16) verts[4]  = mcInterp(help, top,    x,   y,   0);
+	if (edges &   32) verts[5]  = mcInterp(help, top,    x+1, y,   1);
+	if (edges &   64) verts[6]  = mcInterp(help, top,    x,   y+1, 0);
+	if (edges &  128) verts[7]  = mcInterp(help, top,    x,   y,   1);
+	if (edges &  256) verts[8]  = mcInterp(help, bottom, x,   y,   2);
+	if (edges &  512) verts[9]  = mcInterp(help, bottom, x+1, y,   2);
+	if (edges & 1024) verts[10] = mcInterp(help, bottom, x+1, y+1, 2);
+	if (edges & 2048) verts[11] = mcInterp(help, bottom, x,   y+1, 2);
 
 	if (help->mesh.verts == NULL)
 		return 1;
 
 	// Create the triangles.
 	int i = 0;
-	char *tcode = mcTriTable[corners];
+	const char *tcode = mcTriTable[corners];
 	for (;;) {
 		int tcode0 = tcode[i];
 		if (tcode0 < 0)
@@ -506,6 +912,10 @@ static int mcGenerateCell(McHelper *help, int corners, int edges)
 		// Allocate more space if needed.
 		int triidx = help->mesh.ntris++;
 		if (triidx >= help->maxtris) {
+			if (help->fixed) {
+				help->mesh.indices = NULL;
+				return 1;
+			}
 			help->maxtris = help->maxtris ? help->maxtris * 2 : 4096;
 			help->mesh.indices = (int *)MC_REALLOC(help->mesh.indices, help->maxtris*sizeof(int)*3);
 			if (help->mesh.indices == NULL)
@@ -520,158 +930,2990 @@ static int mcGenerateCell(McHelper *help, int corners, int edges)
 	}
 }
 
-McMesh mcGenerate(const float *bmin, const float *bmax, float cellsize, McIsoFn *fn, void *userparam)
+// Everything needed to sample the field over the grid.
+typedef struct {
+	float bmin[3];
+	float cellsize[3];
+	int xd, yd, zd;
+	int batchSize;	// points per batch, if using a McIsoBatchFn
+	int streamed;	// volume is a mapped file, so give paging hints
+	int normals;	// MC_NORMALS_ mode
+	McStreamFn *stream;		// if set, gets each layer's mesh as it's done
+	void *streamparam;
+} McGrid;
+
+// Wraps the C field callbacks (or a volume).
+typedef struct {
+	McIsoFn *fn;
+	McIsoBatchFn *batchFn;
+	McIsoGradFn *gradFn;
+	McIsoBoundFn *boundFn;
+	float lipschitz;
+	void *userparam;
+	const McVolume *volume;
+} McFieldC;
+
+// Samples a McFieldC's value at one point, with whichever function it has.
+MC_STATIC float mcCallFieldC(const McFieldC *field, const float *pos, float *extra)
 {
+	if (field->fn)
+		return field->fn(pos, extra, field->userparam);
+	float value, grad[3];
+	if (field->gradFn)
+		return field->gradFn(pos, grad, extra, field->userparam);
+	field->batchFn(1, &pos[0], &pos[1], &pos[2], &value, extra, field->userparam);
+	return value;
+}
+
+// Bounds a McFieldC over a box, via its bound function or Lipschitz limit.
+MC_STATIC void mcBoundFieldC(const McFieldC *field, const float *bmin, const float *bmax, float *lo, float *hi)
+{
+	if (field->boundFn)
+	{
+		field->boundFn(bmin, bmax, lo, hi, field->userparam);
+		return;
+	}
+
+	// Nothing in the box can be further from the value at the centre
+	// than the limit times the half-diagonal. (plus a little for rounding)
+	float centre[3], extra[MC_EXTRA_DATA+1];
+	float r2 = 0;
+	for (int i=0;i<3;i++)
+	{
+		float d = (bmax[i] - bmin[i]) * 0.5f;
+		centre[i] = bmin[i] + d;
+		r2 += d*d;
+	}
+	float value = mcCallFieldC(field, centre, extra);
+	float r = field->lipschitz * sqrtf(r2) * 1.001f;
+	*lo = value - r;
+	*hi = value + r;
+}
+
+// The sign of each corner in a slice, one bit per corner,
+// with each row padded out to a whole number of words.
+#define MC_ROW_WORDS(xd)	(((xd)+32)/32)
+
+#ifdef __cplusplus
+// In C++ the code that samples the field is a template, so mcGenerateT
+// can inline your functor into it. The C API uses it with a McFieldC.
+#define MC_FIELD_TEMPLATE	template<class McFieldT>
+#define MC_FIELD_FN(name)	name<McFieldT>
+static inline bool mcHasBatch(const McFieldC *field) { return field->batchFn != NULL; }
+template<class Fn> static inline bool mcHasBatch(const Fn *) { return false; }
+static inline const McVolume *mcGetVolume(const McFieldC *field) { return field->volume; }
+template<class Fn> static inline const McVolume *mcGetVolume(const Fn *) { return NULL; }
+static inline float mcCallFn(const McFieldC *field, const float *pos, float *extra) { return mcCallFieldC(field, pos, extra); }
+template<class Fn> static inline float mcCallFn(const Fn *fn, const float *pos, float *extra) { return (*fn)(pos, extra); }
+static inline void mcCallBatch(const McFieldC *field, int count, const float *x, const float *y, const float *z, float *values, float *extra) { field->batchFn(count, x, y, z, values, extra, field->userparam); }
+template<class Fn> static inline void mcCallBatch(const Fn *, int, const float *, const float *, const float *, float *, float *) {}
+static inline bool mcHasGrad(const McFieldC *field) { return field->gradFn != NULL; }
+template<class Fn> static inline bool mcHasGrad(const Fn *) { return false; }
+static inline void mcCallGrad(const McFieldC *field, const float *pos, float *grad, float *extra) { field->gradFn(pos, grad, extra, field->userparam); }
+template<class Fn> static inline void mcCallGrad(const Fn *, const float *, float *, float *) {}
+static inline bool mcHasBound(const McFieldC *field) { return field->boundFn != NULL || field->lipschitz > 0; }
+template<class Fn> static inline bool mcHasBound(const Fn *) { return false; }
+static inline void mcCallBound(const McFieldC *field, const float *bmin, const float *bmax, float *lo, float *hi) { mcBoundFieldC(field, bmin, bmax, lo, hi); }
+template<class Fn> static inline void mcCallBound(const Fn *, const float *, const float *, float *, float *) {}
+#else
+#define MC_FIELD_TEMPLATE
+#define MC_FIELD_FN(name)	name
+typedef McFieldC McFieldT;
+#define mcHasBatch(field)									((field)->batchFn != NULL)
+#define mcGetVolume(field)									((field)->volume)
+#define mcCallFn(field, pos, extra)							mcCallFieldC(field, pos, extra)
+#define mcCallBatch(field, count, x, y, z, values, extra)	(field)->batchFn(count, x, y, z, values, extra, (field)->userparam)
+#define mcHasGrad(field)									((field)->gradFn != NULL)
+#define mcCallGrad(field, pos, grad, extra)					(field)->gradFn(pos, grad, extra, (field)->userparam)
+#define mcHasBound(field)									((field)->boundFn != NULL || (field)->lipschitz > 0)
+#define mcCallBound(field, bmin, bmax, lo, hi)				mcBoundFieldC(field, bmin, bmax, lo, hi)
+#endif
+
+// Working space for calling a McIsoBatchFn.
+typedef struct {
+	float *x, *y, *z, *values, *extra;
+} McBatch;
+
+// Working space for empty-space skipping. The grid is split into
+// blocks of MC_BLOCK_SIZE cells, and layers of blocks are bounded
+// as the slices reach them.
+typedef struct {
+	int nbx, nby, nlayers;
+	int dilate;				// corners to sample around active blocks (grid normals need 1)
+	int layer[2];			// block layers held in fill[layer & 1]
+	float *fill[2];			// per block: a value with the sign of the whole block, or 0 if active
+	unsigned char *need;	// per corner of a slice: does it need sampling?
+	int *index;				// corner for each point of a batch
+} McSkip;
+
+// A range of z-slices, marched into its own mesh.
+typedef struct {
 	McHelper help;
-	float extra[MC_EXTRA_DATA+1];
+	int z0, z1;
+	int *seam[2];	// x/y edge vertices on the bottom/top slices (NULL if not wanted)
+	int failed;
 
-	help.maxverts = 0;
-	help.maxtris = 0;
-	help.mesh.nverts = 0;
-	help.mesh.ntris = 0;
-	help.mesh.verts = NULL;
-	help.mesh.indices = NULL;
-	help.cellsize = cellsize;
+	// For exact meshes: a first pass counts the vertices and triangles,
+	// then a second writes them at the slab's offsets into out. The slab
+	// makes the vertices on its bottom slice, and numbers the ones on its
+	// top slice the same way the slab above will. (from topBase)
+	int counting;
+	int nverts, ntris;
+	McMesh *out;
+	int vbase, tbase, topBase;
+} McSlab;
 
-	// Calculate cell counts for each axis.
-	float invsize = 1.0f / cellsize;
-	int xd = (int)ceilf((bmax[0] - bmin[0]) * invsize);
-	int yd = (int)ceilf((bmax[1] - bmin[1]) * invsize);
-	int zd = (int)ceilf((bmax[2] - bmin[2]) * invsize);
-	if (xd <= 0 || yd <= 0 || zd <= 0)
-		return help.mesh;
-
-	// Allocate 2D grids.
-	int stride = xd+1;
-	McCorner *grid0 = (McCorner *)MC_REALLOC(NULL, sizeof(McCorner) * (xd+1)*(yd+1));
-	McCorner *grid1 = (McCorner *)MC_REALLOC(NULL, sizeof(McCorner) * (xd+1)*(yd+1));
-	if (!grid0 || !grid1)
-		goto end;
+// Gets the mcTriTable case of cell x from the sign bits of the rows of
+// corners around it. (r0/r1 below, r2/r3 above, at y and y+1)
+MC_STATIC int mcCellCase(const uint32_t *r0, const uint32_t *r1, const uint32_t *r2, const uint32_t *r3, int x)
+{
+	int corners = 0;
+	for (int i=0;i<2;i++)
+	{
+		int b = (x+i) >> 5, s = (x+i) & 31;
+		corners |= (int)((r0[b] >> s) & 1) << (0+i);
+		corners |= (int)((r1[b] >> s) & 1) << (3-i);
+		corners |= (int)((r2[b] >> s) & 1) << (4+i);
+		corners |= (int)((r3[b] >> s) & 1) << (7-i);
+	}
+	return corners;
+}
 
-	// Prime the first slice.
-	McCorner *prime = grid0;
+// Counts the vertices and triangles a layer of cells will make, from the
+// sign bits of the slices either side. That's the z edges, and the x/y
+// edges on the bottom slice. (the top one's are counted with the next
+// layer, or for the last one by passing it as both slices and no tris)
+// tris gives the triangles for each mcTriTable case.
+MC_STATIC void mcCountLayer(const uint32_t *signs0, const uint32_t *signs1, int xd, int yd, const unsigned char *tris, int *nverts, int *ntris)
+{
+	int words = MC_ROW_WORDS(xd);
+	int nv = 0, nt = 0;
 	for (int y=0;y<=yd;y++)
 	{
-		for (int x=0;x<=xd;x++,prime++)
+		const uint32_t *r0 = signs0 + y*words;
+		const uint32_t *r2 = signs1 + y*words;
+		for (int w=0;w<words;w++)
+		{
+			// The padding bits are all clear, so only the x edges
+			// need masking off past the end of the row.
+			int cells = xd - w*32;
+			uint32_t next = w+1 < words ? r0[w+1] : 0;
+			uint32_t xedges = r0[w] ^ ((r0[w] >> 1) | (next << 31));
+			if (cells < 32)
+				xedges &= ((uint32_t)1 << cells) - 1;
+			nv += mcBitCount(xedges) + mcBitCount(r0[w] ^ r2[w]);
+			if (y < yd)
+				nv += mcBitCount(r0[w] ^ r0[w+words]);
+		}
+		if (y == yd || !tris)
+			continue;
+
+		// Find the case of each cell, as mcMarchSlice would.
+		const uint32_t *r1 = r0 + words, *r3 = r2 + words;
+		for (int w=0;w<words;w++)
 		{
-			prime->x = bmin[0] + cellsize*x;
-			prime->y = bmin[1] + cellsize*y;
-			prime->z = bmin[2];
-			prime->u.value = fn(&prime->x, extra, userparam);
-			prime->vtx[0] = prime->vtx[1] = prime->vtx[2] = -1;
+			uint32_t any = r0[w] | r1[w] | r2[w] | r3[w];
+			uint32_t all = r0[w] & r1[w] & r2[w] & r3[w];
+			uint32_t anyNext = 0, allNext = 0;
+			if (w+1 < words)
+			{
+				anyNext = r0[w+1] | r1[w+1] | r2[w+1] | r3[w+1];
+				allNext = r0[w+1] & r1[w+1] & r2[w+1] & r3[w+1];
+			}
+			uint32_t mixed = (any | (any >> 1) | (anyNext << 31)) & ~(all & ((all >> 1) | (allNext << 31)));
+			int cells = xd - w*32;
+			if (cells < 32)
+				mixed &= ((uint32_t)1 << cells) - 1;
+
+			while (mixed)
+			{
+				int x = w*32 + mcLowestBit(mixed);
+				mixed &= mixed - 1;
+				nt += tris[mcCellCase(r0, r1, r2, r3, x)];
+			}
 		}
 	}
+	*nverts += nv;
+	*ntris += nt;
+}
 
-	for (int z=0;z<zd;z++)
+// Numbers the vertices on the x/y edges of a slice two slabs share,
+// in the same order from either side. The slab above makes them first
+// thing (base < 0), and the one below just takes the numbers they'll get.
+MC_STATIC int mcSeamVertices(McHelper *help, McSlice *slice, int base)
+{
+	int stride = help->xd+1;
+	int words = MC_ROW_WORDS(help->xd);
+	for (int y=0;y<=help->yd;y++)
 	{
-		// Read the next slice.
-		McCorner *slice = grid1;
-		for (int y=0;y<=yd;y++)
+		const uint32_t *row = slice->signs + y*words;
+		for (int x=0;x<=help->xd;x++)
 		{
-			for (int x=0;x<=xd;x++,slice++)
+			int a = y*stride + x;
+			uint32_t sign = (row[x>>5] >> (x & 31)) & 1;
+			for (int axis=0;axis<2;axis++)
 			{
-				slice->x = bmin[0] + cellsize*x;
-				slice->y = bmin[1] + cellsize*y;
-				slice->z = bmin[2] + cellsize*(z+1);
-				slice->u.value = fn(&slice->x, extra, userparam);
-				slice->vtx[0] = slice->vtx[1] = slice->vtx[2] = -1;
+				if (axis == 0 ? x == help->xd : y == help->yd)
+					continue;
+				int bx = x + (axis == 0);
+				const uint32_t *brow = axis == 0 ? row : row + words;
+				if (((brow[bx>>5] >> (bx & 31)) & 1) == sign)
+					continue;
+				if (base < 0)
+					mcInterp(help, slice, x, y, axis);
+				else
+					slice->vtx[axis][a] = base++;
 			}
 		}
+	}
+	return base < 0 && help->mesh.verts == NULL;
+}
 
-		// March over it.
-		for (int y=0;y<yd;y++)
-		{
-			// Get the eight corners of the cell.
-			int pos = y*stride;
-			McCorner *bottom = grid0 + pos;
-			McCorner *top = grid1 + pos;
-			help.c[0] = bottom;
-			help.c[1] = bottom + 1;
-			help.c[2] = bottom + stride + 1;
-			help.c[3] = bottom + stride;
-			help.c[4] = top;
-			help.c[5] = top + 1;
-			help.c[6] = top + stride + 1;
-			help.c[7] = top + stride;
-
-			int count = xd;
-			do {
-				// See which vertices are inside/outside the volume.
-				int corners;
-				corners  = (help.c[0]->u.sign >> 31) & 1;
-				corners |= (help.c[1]->u.sign >> 30) & 2;
-				corners |= (help.c[2]->u.sign >> 29) & 4;
-				corners |= (help.c[3]->u.sign >> 28) & 8;
-				corners |= (help.c[4]->u.sign >> 27) & 16;
-				corners |= (help.c[5]->u.sign >> 26) & 32;
-				corners |= (help.c[6]->u.sign >> 25) & 64;
-				corners |= (help.c[7]->u.sign >> 24) & 128;
-
-				// See which edges intersect the cell.
-				int edges = mcEdgeTable[corners];
-				if (edges != 0)
-				{
-					if (mcGenerateCell(&help, corners, edges))
-					{
-						// Out of memory.
-						mcFree(&help.mesh);
-						goto end;
-					}
-				}
+// Lays out a slice's arrays in mem, which needs MC_SLICE_WORDS of space.
+// (slices of volumes have no values array)
+#define MC_SLICE_WORDS(count, signCount, values)	((size_t)(count)*(2+MC_EXTRA_DATA+((values) ? 1 : 0)) + (signCount))
+MC_STATIC void mcInitSlice(McSlice *slice, uint32_t *mem, int count, int values)
+{
+	slice->values = values ? (float *)mem : NULL;
+	if (values)
+		mem += count;
+	slice->vtx[0] = (int *)mem;
+	slice->vtx[1] = (int *)(mem + count);
+#if MC_EXTRA_DATA > 0
+	slice->extra = (float *)(mem + (size_t)count*2);
+#endif
+	slice->signs = mem + (size_t)count*(2+MC_EXTRA_DATA);
+	slice->z = -1;
+	slice->vol = NULL;
+	slice->vbase = 0;
+}
+
+// Gets a slice ready for reading slice z into.
+MC_STATIC void mcResetSlice(McSlice *slice, int count, int z)
+{
+	slice->z = z;
+	for (int n=0;n<count;n++)
+		slice->vtx[0][n] = slice->vtx[1][n] = -1;
+}
+
+// Works out the sign bits for a slice from its values, 4 at a time with SIMD.
+MC_STATIC void mcSliceSigns(McSlice *slice, int xd, int yd)
+{
+	int words = MC_ROW_WORDS(xd);
+	const float *values = slice->values;
+	uint32_t *signs = slice->signs;
+	for (int y=0;y<=yd;y++)
+	{
+		for (int w=0;w<words;w++)
+			signs[w] = 0;
+		int x = 0;
+#if MC_SSE
+		for (;x+4<=xd+1;x+=4)
+			signs[x>>5] |= (uint32_t)_mm_movemask_ps(_mm_loadu_ps(values + x)) << (x & 31);
+#endif
+		for (;x<=xd;x++)
+			signs[x>>5] |= (uint32_t)mcSignBit(values[x]) << (x & 31);
+		values += xd+1;
+		signs += words;
+	}
+}
+
+#if MC_SSE
+// Gets the sign bits for a contiguous row of samples, 4/16/8 at a time.
+// Integer samples are compared as integers, against the first whole
+// number at or above the iso value. Returns how many samples it did.
+MC_STATIC int mcVolumeRowSigns(const McVolume *vol, ptrdiff_t base, int count, uint32_t *bits)
+{
+	int x = 0;
+	if (vol->type == MC_VOLUME_FLOAT)
+	{
+		const float *src = (const float *)vol->data + base;
+		__m128 iso = _mm_set1_ps(vol->iso);
+		for (;x+4<=count;x+=4)
+			bits[x>>5] |= (uint32_t)_mm_movemask_ps(_mm_sub_ps(_mm_loadu_ps(src + x), iso)) << (x & 31);
+		return x;
+	}
 
-				for (int i=0;i<8;i++)
-					help.c[i]++;
-			} while (--count);
+	// (the compares are signed, so flip the top bits to compare unsigned)
+	float limit = ceilf(vol->iso);
+	if (vol->type == MC_VOLUME_UINT8 && limit >= 1 && limit <= 255)
+	{
+		const uint8_t *src = (const uint8_t *)vol->data + base;
+		__m128i flip = _mm_set1_epi8((char)0x80);
+		__m128i iso = _mm_set1_epi8((char)((int)limit ^ 0x80));
+		for (;x+16<=count;x+=16)
+		{
+			__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + x)), flip);
+			bits[x>>5] |= (uint32_t)_mm_movemask_epi8(_mm_cmplt_epi8(v, iso)) << (x & 31);
+		}
+	}
+	if (vol->type == MC_VOLUME_UINT16 && limit >= 1 && limit <= 65535)
+	{
+		const uint16_t *src = (const uint16_t *)vol->data + base;
+		__m128i flip = _mm_set1_epi16((short)0x8000);
+		__m128i iso = _mm_set1_epi16((short)((int)limit ^ 0x8000));
+		for (;x+8<=count;x+=8)
+		{
+			__m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + x)), flip);
+			__m128i inside = _mm_cmplt_epi16(v, iso);
+			bits[x>>5] |= (uint32_t)(_mm_movemask_epi8(_mm_packs_epi16(inside, inside)) & 0xff) << (x & 31);
 		}
+	}
+	return x;
+}
+#endif
 
-		// Swap slices.
-		McCorner *tmp = grid0;
-		grid0 = grid1;
-		grid1 = tmp;
-	}
-
-	// Calculate all normals and extra data.
-	float epsilon = cellsize * 0.1f;
-	for (int n=0;n<help.mesh.nverts;n++)
-	{
-		McVertex *v = &help.mesh.verts[n];
-		float v1[3] = { v->x - epsilon, v->y, v->z };
-		float v2[3] = { v->x, v->y - epsilon, v->z };
-		float v3[3] = { v->x, v->y, v->z - epsilon };
-
-		// Sample the field locally 4 times to compute the field gradient.
-		float f1 = fn(v1, extra, userparam);
-		float f2 = fn(v2, extra, userparam);
-		float f3 = fn(v3, extra, userparam);
-		float f0 = fn(&v->x, extra, userparam);
-		v->nx = f0 - f1;
-		v->ny = f0 - f2;
-		v->nz = f0 - f3;
-
-		// Normalize it.
-		float len = sqrtf(v->nx*v->nx + v->ny*v->ny + v->nz*v->nz);
-		float s = (len >= 0.00000000000001f) ? 1.0f/len : 0;
-		v->nx *= s;
-		v->ny *= s;
-		v->nz *= s;
+// Reads a slice straight out of a volume. Only the sign bits are made,
+// straight from the samples (with SIMD when the rows are contiguous),
+// and the values are read from the volume as the edges need them.
+MC_STATIC void mcReadVolumeSlice(const McGrid *grid, const McVolume *vol, McSlice *slice, int z)
+{
+	int words = MC_ROW_WORDS(grid->xd);
+	int count = (grid->xd+1)*(grid->yd+1);
+	ptrdiff_t step = vol->stride[0];
+	mcResetSlice(slice, count, z);
+	slice->vol = vol;
+	slice->vbase = (ptrdiff_t)z*vol->stride[2];
+#if MC_EXTRA_DATA > 0
+	for (int n=0;n<count*MC_EXTRA_DATA;n++)
+		slice->extra[n] = 0;
+#endif
+	for (int y=0;y<=grid->yd;y++)
+	{
+		ptrdiff_t base = (ptrdiff_t)z*vol->stride[2] + (ptrdiff_t)y*vol->stride[1];
+		uint32_t *rowSigns = slice->signs + y*words;
+		for (int w=0;w<words;w++)
+			rowSigns[w] = 0;
+
+		int x = 0;
+#if MC_SSE
+		if (step == 1)
+			x = mcVolumeRowSigns(vol, base, grid->xd+1, rowSigns);
+#endif
+		for (;x<=grid->xd;x++)
+			rowSigns[x>>5] |= (uint32_t)mcSignBit(mcVolumeAt(vol, base + x*step) - vol->iso) << (x & 31);
+	}
+}
+
+// Works out which blocks in a layer can contain the surface, by
+// bounding the field over a range of blocks, and splitting the range
+// up if the surface might be in it.
+MC_FIELD_TEMPLATE static void mcBoundBlocks(const McGrid *grid, const McFieldT *field, McSkip *skip, float *fill, int z0, int z1, int bx0, int by0, int bx1, int by1)
+{
+	int x1 = bx1*MC_BLOCK_SIZE < grid->xd ? bx1*MC_BLOCK_SIZE : grid->xd;
+	int y1 = by1*MC_BLOCK_SIZE < grid->yd ? by1*MC_BLOCK_SIZE : grid->yd;
+	float bmin[3], bmax[3];
+	bmin[0] = grid->bmin[0] + grid->cellsize[0]*(bx0*MC_BLOCK_SIZE);
+	bmin[1] = grid->bmin[1] + grid->cellsize[1]*(by0*MC_BLOCK_SIZE);
+	bmin[2] = grid->bmin[2] + grid->cellsize[2]*z0;
+	bmax[0] = grid->bmin[0] + grid->cellsize[0]*x1;
+	bmax[1] = grid->bmin[1] + grid->cellsize[1]*y1;
+	bmax[2] = grid->bmin[2] + grid->cellsize[2]*z1;
+
+	float lo, hi;
+	mcCallBound(field, bmin, bmax, &lo, &hi);
+	float value = lo > 0 ? lo : hi < 0 ? hi : 0;
+	if (value != 0 || (bx1-bx0 == 1 && by1-by0 == 1))
+	{
+		for (int by=by0;by<by1;by++)
+			for (int bx=bx0;bx<bx1;bx++)
+				fill[by*skip->nbx + bx] = value;
+		return;
+	}
+
+	// Split the longer side, and try each half.
+	if (bx1-bx0 >= by1-by0)
+	{
+		int mid = (bx0 + bx1) / 2;
+		MC_FIELD_FN(mcBoundBlocks)(grid, field, skip, fill, z0, z1, bx0, by0, mid, by1);
+		MC_FIELD_FN(mcBoundBlocks)(grid, field, skip, fill, z0, z1, mid, by0, bx1, by1);
+	} else {
+		int mid = (by0 + by1) / 2;
+		MC_FIELD_FN(mcBoundBlocks)(grid, field, skip, fill, z0, z1, bx0, by0, bx1, mid);
+		MC_FIELD_FN(mcBoundBlocks)(grid, field, skip, fill, z0, z1, bx0, mid, bx1, by1);
+	}
+}
 
+// Gets the block fill values for a layer, bounding it if needed.
+MC_FIELD_TEMPLATE static const float *mcSkipLayer(const McGrid *grid, const McFieldT *field, McSkip *skip, int layer)
+{
+	float *fill = skip->fill[layer & 1];
+	if (skip->layer[layer & 1] != layer)
+	{
+		int z0 = layer*MC_BLOCK_SIZE;
+		int z1 = z0+MC_BLOCK_SIZE < grid->zd ? z0+MC_BLOCK_SIZE : grid->zd;
+		MC_FIELD_FN(mcBoundBlocks)(grid, field, skip, fill, z0, z1, 0, 0, skip->nbx, skip->nby);
+		skip->layer[layer & 1] = layer;
+	}
+	return fill;
+}
+
+// Samples the corners queued up in a batch.
+MC_FIELD_TEMPLATE static void mcSkipBatch(const McFieldT *field, const McSkip *skip, McSlice *slice, int total, McBatch *batch, int count)
+{
+	mcCallBatch(field, count, batch->x, batch->y, batch->z, batch->values, batch->extra);
+	for (int n=0;n<count;n++)
+	{
+		int c = skip->index[n];
+		slice->values[c] = batch->values[n];
 #if MC_EXTRA_DATA > 0
-		// Copy any additional data channels across too.
 		for (int i=0;i<MC_EXTRA_DATA;i++)
-			v->extra[i] = extra[i];
+			slice->extra[i*total + c] = batch->extra[i*count + n];
+#else
+		(void)total;
 #endif
 	}
+}
 
-end:
-	MC_REALLOC(grid0, 0);
-	MC_REALLOC(grid1, 0);
-	return help.mesh;
+// Reads a slice, only sampling the field around blocks that might
+// contain the surface. Every other corner just gets a value of the
+// right sign, which is all the march needs from it.
+MC_FIELD_TEMPLATE static void mcReadSkipSlice(const McGrid *grid, const McFieldT *field, McSkip *skip, McSlice *slice, int z, McBatch *batch)
+{
+	int stride = grid->xd+1;
+	int count = stride*(grid->yd+1);
+	mcResetSlice(slice, count, z);
+#if MC_EXTRA_DATA > 0
+	for (int n=0;n<count*MC_EXTRA_DATA;n++)
+		slice->extra[n] = 0;
+#endif
+	int d = skip->dilate;
+	for (int n=0;n<count;n++)
+		skip->need[n] = 0;
+
+	// Mark the corners of the active blocks in the layers touching this slice.
+	int top = (z+d) / MC_BLOCK_SIZE;
+	for (int layer=top-2;layer<=top;layer++)
+	{
+		if (layer < 0 || layer >= skip->nlayers)
+			continue;
+		if (z < layer*MC_BLOCK_SIZE - d || z > (layer+1)*MC_BLOCK_SIZE + d)
+			continue;
+
+		const float *fill = MC_FIELD_FN(mcSkipLayer)(grid, field, skip, layer);
+		for (int by=0;by<skip->nby;by++)
+		{
+			for (int bx=0;bx<skip->nbx;bx++)
+			{
+				if (fill[by*skip->nbx + bx] != 0)
+					continue;
+				int x0 = bx*MC_BLOCK_SIZE - d, x1 = (bx+1)*MC_BLOCK_SIZE + d;
+				int y0 = by*MC_BLOCK_SIZE - d, y1 = (by+1)*MC_BLOCK_SIZE + d;
+				x0 = x0 < 0 ? 0 : x0;
+				y0 = y0 < 0 ? 0 : y0;
+				x1 = x1 > grid->xd ? grid->xd : x1;
+				y1 = y1 > grid->yd ? grid->yd : y1;
+				for (int y=y0;y<=y1;y++)
+					for (int x=x0;x<=x1;x++)
+						skip->need[y*stride + x] = 1;
+			}
+		}
+	}
+
+	// The layer holding this slice says what sign the rest have.
+	int layer = z / MC_BLOCK_SIZE < skip->nlayers ? z / MC_BLOCK_SIZE : skip->nlayers-1;
+	const float *fill = skip->fill[layer & 1];
+
+	int queued = 0;
+	for (int y=0;y<=grid->yd;y++)
+	{
+		int by = y / MC_BLOCK_SIZE < skip->nby ? y / MC_BLOCK_SIZE : skip->nby-1;
+		for (int x=0;x<=grid->xd;x++)
+		{
+			int n = y*stride + x;
+			if (!skip->need[n])
+			{
+				int bx = x / MC_BLOCK_SIZE < skip->nbx ? x / MC_BLOCK_SIZE : skip->nbx-1;
+				slice->values[n] = fill[by*skip->nbx + bx];
+				continue;
+			}
+
+			float pos[3];
+			pos[0] = grid->bmin[0] + grid->cellsize[0]*x;
+			pos[1] = grid->bmin[1] + grid->cellsize[1]*y;
+			pos[2] = grid->bmin[2] + grid->cellsize[2]*z;
+			if (!mcHasBatch(field))
+			{
+				float extra[MC_EXTRA_DATA+1];
+				slice->values[n] = mcCallFn(field, pos, extra);
+#if MC_EXTRA_DATA > 0
+				for (int i=0;i<MC_EXTRA_DATA;i++)
+					slice->extra[i*count + n] = extra[i];
+#endif
+				continue;
+			}
+
+			// Queue it up for the next batch.
+			batch->x[queued] = pos[0];
+			batch->y[queued] = pos[1];
+			batch->z[queued] = pos[2];
+			skip->index[queued++] = n;
+			if (queued == grid->batchSize)
+			{
+				MC_FIELD_FN(mcSkipBatch)(field, skip, slice, count, batch, queued);
+				queued = 0;
+			}
+		}
+	}
+	if (queued)
+		MC_FIELD_FN(mcSkipBatch)(field, skip, slice, count, batch, queued);
+	mcSliceSigns(slice, grid->xd, grid->yd);
+}
+
+MC_FIELD_TEMPLATE static void mcReadSlice(const McGrid *grid, const McFieldT *field, McSlice *slice, int z, McBatch *batch, McSkip *skip)
+{
+	if (skip)
+	{
+		MC_FIELD_FN(mcReadSkipSlice)(grid, field, skip, slice, z, batch);
+		return;
+	}
+
+	const McVolume *vol = mcGetVolume(field);
+	if (vol)
+	{
+		mcReadVolumeSlice(grid, vol, slice, z);
+		return;
+	}
+
+	int stride = grid->xd+1;
+	int total = stride*(grid->yd+1);
+	mcResetSlice(slice, total, z);
+	if (!mcHasBatch(field))
+	{
+		int n = 0;
+		for (int y=0;y<=grid->yd;y++)
+		{
+			for (int x=0;x<=grid->xd;x++,n++)
+			{
+				float pos[3], extra[MC_EXTRA_DATA+1];
+				pos[0] = grid->bmin[0] + grid->cellsize[0]*x;
+				pos[1] = grid->bmin[1] + grid->cellsize[1]*y;
+				pos[2] = grid->bmin[2] + grid->cellsize[2]*z;
+				slice->values[n] = mcCallFn(field, pos, extra);
+#if MC_EXTRA_DATA > 0
+				for (int i=0;i<MC_EXTRA_DATA;i++)
+					slice->extra[i*total + n] = extra[i];
+#endif
+			}
+		}
+		mcSliceSigns(slice, grid->xd, grid->yd);
+		return;
+	}
+
+	// Evaluate as many whole rows at once as will fit in a batch,
+	// with the values going straight into the slice.
+	int rows = grid->batchSize / stride;
+	for (int y0=0;y0<=grid->yd;y0+=rows)
+	{
+		int count = grid->yd+1 - y0;
+		if (count > rows)
+			count = rows;
+		count *= stride;
+
+		int first = y0*stride;
+		for (int n=0;n<count;n++)
+		{
+			batch->x[n] = grid->bmin[0] + grid->cellsize[0]*(n % stride);
+			batch->y[n] = grid->bmin[1] + grid->cellsize[1]*(y0 + n / stride);
+			batch->z[n] = grid->bmin[2] + grid->cellsize[2]*z;
+		}
+		mcCallBatch(field, count, batch->x, batch->y, batch->z, slice->values + first, batch->extra);
+
+#if MC_EXTRA_DATA > 0
+		for (int i=0;i<MC_EXTRA_DATA;i++)
+			for (int n=0;n<count;n++)
+				slice->extra[i*total + first + n] = batch->extra[i*count + n];
+#endif
+	}
+	mcSliceSigns(slice, grid->xd, grid->yd);
+}
+
+MC_STATIC int mcMarchSlice(McHelper *help, McSlice *grid0, McSlice *grid1, int xd, int yd)
+{
+	int words = MC_ROW_WORDS(xd);
+	int count = (xd+1)*(yd+1);
+	help->bottom = grid0;
+	help->top = grid1;
+	for (int n=0;n<count;n++)
+		help->zvtx[n] = -1;
+
+	for (int y=0;y<yd;y++)
+	{
+		// Sign bits for the four rows of corners around this row of cells.
+		const uint32_t *r0 = grid0->signs + y*words;
+		const uint32_t *r1 = r0 + words;
+		const uint32_t *r2 = grid1->signs + y*words;
+		const uint32_t *r3 = r2 + words;
+
+		for (int w=0;w<words;w++)
+		{
+			// Find the cells that have corners on both sides of the surface.
+			// Each cell needs the bits for corner x and x+1, so the next
+			// word supplies the last one.
+			uint32_t any = r0[w] | r1[w] | r2[w] | r3[w];
+			uint32_t all = r0[w] & r1[w] & r2[w] & r3[w];
+			uint32_t anyNext = 0, allNext = 0;
+			if (w+1 < words)
+			{
+				anyNext = r0[w+1] | r1[w+1] | r2[w+1] | r3[w+1];
+				allNext = r0[w+1] & r1[w+1] & r2[w+1] & r3[w+1];
+			}
+			uint32_t mixed = (any | (any >> 1) | (anyNext << 31)) & ~(all & ((all >> 1) | (allNext << 31)));
+			int cells = xd - w*32;
+			if (cells < 32)
+				mixed &= ((uint32_t)1 << cells) - 1;
+
+			while (mixed)
+			{
+				int x = w*32 + mcLowestBit(mixed);
+				mixed &= mixed - 1;
+
+				// See which corners are inside/outside the volume,
+				// and which edges intersect the cell.
+				int corners = mcCellCase(r0, r1, r2, r3, x);
+				int edges = mcEdgeTable[corners];
+				if (mcGenerateCell(help, x, y, corners, edges))
+					return 1; // out of memory
+			}
+		}
+	}
+	return 0;
+}
+
+// Reads a volume sample, clamping to the edges.
+MC_STATIC float mcVolumeSample(const McVolume *vol, int x, int y, int z)
+{
+	x = x < 0 ? 0 : x >= vol->size[0] ? vol->size[0]-1 : x;
+	y = y < 0 ? 0 : y >= vol->size[1] ? vol->size[1]-1 : y;
+	z = z < 0 ? 0 : z >= vol->size[2] ? vol->size[2]-1 : z;
+	return mcVolumeAt(vol, (ptrdiff_t)x*vol->stride[0] + (ptrdiff_t)y*vol->stride[1] + (ptrdiff_t)z*vol->stride[2]);
+}
+
+// Gets normals from a volume, by interpolating the central-difference
+// gradients at the corners of the cell each vertex is in.
+MC_STATIC void mcCalcVolumeNormals(McHelper *help, const McVolume *vol, int first)
+{
+	for (int n=first;n<help->mesh.nverts;n++)
+	{
+		McVertex *v = &help->mesh.verts[n];
+		int cell[3];
+		float frac[3];
+		for (int i=0;i<3;i++)
+		{
+			float f = ((&v->x)[i] - vol->origin[i]) / vol->spacing[i];
+			int c = (int)floorf(f);
+			if (c < 0) c = 0;
+			if (c > vol->size[i]-2) c = vol->size[i]-2;
+			if (c < 0) c = 0;
+			cell[i] = c;
+			frac[i] = f - c;
+		}
+
+		float grad[3] = { 0, 0, 0 };
+		for (int k=0;k<8;k++)
+		{
+			int x = cell[0] + (k & 1);
+			int y = cell[1] + ((k >> 1) & 1);
+			int z = cell[2] + (k >> 2);
+			float w = ((k & 1) ? frac[0] : 1-frac[0])
+					* ((k & 2) ? frac[1] : 1-frac[1])
+					* ((k & 4) ? frac[2] : 1-frac[2]);
+			if (w == 0)
+				continue;
+			grad[0] += w * (mcVolumeSample(vol, x+1, y, z) - mcVolumeSample(vol, x-1, y, z)) / vol->spacing[0];
+			grad[1] += w * (mcVolumeSample(vol, x, y+1, z) - mcVolumeSample(vol, x, y-1, z)) / vol->spacing[1];
+			grad[2] += w * (mcVolumeSample(vol, x, y, z+1) - mcVolumeSample(vol, x, y, z-1)) / vol->spacing[2];
+		}
+		mcSetNormal(v, grad[0], grad[1], grad[2]);
+	}
+}
+
+MC_FIELD_TEMPLATE static void mcCalcNormals(McHelper *help, const McGrid *grid, const McFieldT *field, McBatch *batch)
+{
+	// The extra data was interpolated from the corners, so this only
+	// needs to sample the field for the gradient. (and grid normals
+	// were already done during the march)
+	float extra[MC_EXTRA_DATA+1];
+	if (mcHasGrad(field))
+	{
+		// The field knows its own gradient, so one call will do.
+		for (int n=0;n<help->mesh.nverts;n++)
+		{
+			McVertex *v = &help->mesh.verts[n];
+			float grad[3];
+			mcCallGrad(field, &v->x, grad, extra);
+			mcSetNormal(v, grad[0], grad[1], grad[2]);
+		}
+		return;
+	}
+	if (grid->normals == MC_NORMALS_GRID)
+		return;
+
+	// Calculate all normals.
+	float epsilon = grid->cellsize[0] * 0.1f;
+	if (!mcHasBatch(field))
+	{
+		for (int n=0;n<help->mesh.nverts;n++)
+		{
+			McVertex *v = &help->mesh.verts[n];
+			float v1[3] = { v->x - epsilon, v->y, v->z };
+			float v2[3] = { v->x, v->y - epsilon, v->z };
+			float v3[3] = { v->x, v->y, v->z - epsilon };
+
+			// Sample the field locally 4 times to compute the field gradient.
+			float f1 = mcCallFn(field, v1, extra);
+			float f2 = mcCallFn(field, v2, extra);
+			float f3 = mcCallFn(field, v3, extra);
+			float f0 = mcCallFn(field, &v->x, extra);
+			mcSetNormal(v, f0 - f1, f0 - f2, f0 - f3);
+		}
+		return;
+	}
+
+	// Same again in batches, with the four samples for each
+	// vertex split into four runs.
+	int per = grid->batchSize / 4;
+	for (int first=0;first<help->mesh.nverts;first+=per)
+	{
+		int count = help->mesh.nverts - first;
+		if (count > per)
+			count = per;
+
+		McVertex *v = &help->mesh.verts[first];
+		for (int n=0;n<count;n++)
+		{
+			for (int i=0;i<4;i++)
+			{
+				batch->x[i*count+n] = v[n].x - (i == 0 ? epsilon : 0);
+				batch->y[i*count+n] = v[n].y - (i == 1 ? epsilon : 0);
+				batch->z[i*count+n] = v[n].z - (i == 2 ? epsilon : 0);
+			}
+		}
+		mcCallBatch(field, count*4, batch->x, batch->y, batch->z, batch->values, batch->extra);
+
+		for (int n=0;n<count;n++)
+		{
+			float *f = batch->values + n;
+			float f0 = f[count*3];
+			mcSetNormal(&v[n], f0 - f[0], f0 - f[count], f0 - f[count*2]);
+		}
+	}
+}
+
+// Records which vertices were made on the x/y edges of a slice.
+MC_STATIC void mcSaveSeam(const McSlice *slice, int count, int *seam)
+{
+	for (int n=0;n<count;n++)
+	{
+		seam[n*2+0] = slice->vtx[0][n];
+		seam[n*2+1] = slice->vtx[1][n];
+	}
+}
+
+MC_FIELD_TEMPLATE static void mcGenerateSlab(const McGrid *grid, const McFieldT *field, McSlab *slab)
+{
+	McHelper *help = &slab->help;
+	help->maxverts = 0;
+	help->maxtris = 0;
+	help->base = 0;
+	help->fixed = 0;
+	help->mesh.nverts = 0;
+	help->mesh.ntris = 0;
+	help->mesh.verts = NULL;
+	help->mesh.indices = NULL;
+	if (slab->out)
+	{
+		help->maxverts = slab->nverts;
+		help->maxtris = slab->ntris;
+		help->base = slab->vbase;
+		help->fixed = 1;
+		help->mesh.verts = slab->out->verts + slab->vbase;
+		help->mesh.indices = slab->out->indices + (size_t)slab->tbase*3;
+	}
+	for (int i=0;i<3;i++)
+	{
+		help->bmin[i] = grid->bmin[i];
+		help->cellsize[i] = grid->cellsize[i];
+	}
+	for (int i=0;i<4;i++)
+		help->slices[i] = NULL;
+	help->xd = grid->xd;
+	help->yd = grid->yd;
+	slab->failed = 0;
+	const McVolume *vol = mcGetVolume(field);
+
+	// Grid normals need the slices either side of the layer too,
+	// so we read one slice ahead and keep the one behind.
+	int ahead = !vol && !mcHasGrad(field) && grid->normals == MC_NORMALS_GRID && !slab->counting;
+	int nslices = ahead ? 4 : 2;
+
+	// Allocate 2D grids (and the z edge vertices between a pair),
+	// and space for batches.
+	int count = (grid->xd+1)*(grid->yd+1);
+	size_t sliceWords = MC_SLICE_WORDS(count, MC_ROW_WORDS(grid->xd)*(grid->yd+1), !vol);
+	uint32_t *sliceMem = (uint32_t *)MC_REALLOC(NULL, sizeof(uint32_t) * (sliceWords * nslices + count));
+	McSlice slices[4];
+	McSlice *grid0 = &slices[0], *grid1 = &slices[1];
+	McSlice *above = ahead ? &slices[2] : NULL, *below = ahead ? &slices[3] : NULL;
+	if (sliceMem)
+	{
+		for (int i=0;i<nslices;i++)
+			mcInitSlice(&slices[i], sliceMem + sliceWords*i, count, !vol);
+		help->zvtx = (int *)(sliceMem + sliceWords*nslices);
+	}
+	McBatch batch;
+	batch.x = NULL;
+	if (mcHasBatch(field))
+	{
+		batch.x = (float *)MC_REALLOC(NULL, sizeof(float) * grid->batchSize * (4+MC_EXTRA_DATA));
+		batch.y = batch.x + grid->batchSize;
+		batch.z = batch.y + grid->batchSize;
+		batch.values = batch.z + grid->batchSize;
+		batch.extra = batch.values + grid->batchSize;
+	}
+
+	// Set up empty-space skipping.
+	McSkip skip;
+	McSkip *skipPtr = NULL;
+	skip.fill[0] = NULL;
+	skip.need = NULL;
+	skip.index = NULL;
+	if (!vol && mcHasBound(field))
+	{
+		skip.nbx = (grid->xd + MC_BLOCK_SIZE-1) / MC_BLOCK_SIZE;
+		skip.nby = (grid->yd + MC_BLOCK_SIZE-1) / MC_BLOCK_SIZE;
+		skip.nlayers = (grid->zd + MC_BLOCK_SIZE-1) / MC_BLOCK_SIZE;
+		skip.dilate = ahead;
+		skip.layer[0] = skip.layer[1] = -1;
+		skip.fill[0] = (float *)MC_REALLOC(NULL, sizeof(float) * skip.nbx * skip.nby * 2);
+		skip.fill[1] = skip.fill[0] + skip.nbx * skip.nby;
+		skip.need = (unsigned char *)MC_REALLOC(NULL, count);
+		skip.index = (int *)MC_REALLOC(NULL, sizeof(int) * grid->batchSize);
+		skipPtr = &skip;
+		if (!skip.fill[0] || !skip.need || !skip.index)
+			goto fail;
+	}
+	if (!sliceMem || (mcHasBatch(field) && !batch.x))
+		goto fail;
+
+	// Counting needs the triangles for each case.
+	unsigned char tris[256];
+	if (slab->counting)
+	{
+		slab->nverts = 0;
+		slab->ntris = 0;
+		for (int i=0;i<256;i++)
+		{
+			int n = 0;
+			while (mcTriTable[i][n] >= 0)
+				n += 3;
+			tris[i] = (unsigned char)(n / 3);
+		}
+	}
+
+	// Prime the first slice(s).
+	if (ahead && slab->z0 > 0)
+		mcReadSlice(grid, field, below, slab->z0-1, &batch, skipPtr);
+	mcReadSlice(grid, field, grid0, slab->z0, &batch, skipPtr);
+	if (ahead)
+		mcReadSlice(grid, field, grid1, slab->z0+1, &batch, skipPtr);
+
+	for (int z=slab->z0;z<slab->z1;z++)
+	{
+		if (grid->streamed)
+			mcVolumeHint(vol, z+2, z+4, 1);
+
+		// Read the next slice, and march over it.
+		int first = help->mesh.nverts;
+		if (ahead)
+		{
+			if (z+2 <= grid->zd)
+				mcReadSlice(grid, field, above, z+2, &batch, skipPtr);
+			help->slices[0] = z > 0 ? below : grid0;
+			help->slices[1] = grid0;
+			help->slices[2] = grid1;
+			help->slices[3] = z+2 <= grid->zd ? above : grid1;
+		} else {
+			mcReadSlice(grid, field, grid1, z+1, &batch, skipPtr);
+		}
+		if (slab->counting)
+		{
+			mcCountLayer(grid0->signs, grid1->signs, grid->xd, grid->yd, tris, &slab->nverts, &slab->ntris);
+			if (z+1 == grid->zd)
+				mcCountLayer(grid1->signs, grid1->signs, grid->xd, grid->yd, NULL, &slab->nverts, &slab->ntris);
+		} else {
+			if (slab->out && z == slab->z0 && z > 0 && mcSeamVertices(help, grid0, -1))
+				goto fail;
+			if (slab->out && z+1 == slab->z1 && slab->topBase >= 0)
+				mcSeamVertices(help, grid1, slab->topBase);
+			if (mcMarchSlice(help, grid0, grid1, grid->xd, grid->yd))
+				goto fail;
+		}
+
+		// Volumes get their normals as we go, while the slices
+		// around the new vertices are still in memory. (unless the
+		// caller is going to fill them in from a field afterwards)
+		if (vol && !slab->counting)
+		{
+			if (grid->normals == MC_NORMALS_GRID)
+				mcCalcVolumeNormals(help, vol, first);
+			if (grid->streamed)
+				mcVolumeHint(vol, slab->z0, z-1, 0);
+		}
+
+		// Pass the layer on if streaming, and start the next one afresh.
+		// Its vertices keep counting on from these.
+		if (grid->stream && (help->mesh.nverts || help->mesh.ntris))
+		{
+			if (!vol)
+				mcCalcNormals(help, grid, field, &batch);
+			if (grid->stream(help->mesh.verts, help->mesh.nverts, help->mesh.indices, help->mesh.ntris, grid->streamparam))
+				goto fail;
+			help->base += help->mesh.nverts;
+			help->mesh.nverts = 0;
+			help->mesh.ntris = 0;
+		}
+
+		if (z == slab->z0 && slab->seam[0])
+			mcSaveSeam(grid0, count, slab->seam[0]);
+
+		// Move the slices down.
+		McSlice *tmp = grid0;
+		grid0 = grid1;
+		if (ahead)
+		{
+			grid1 = above;
+			above = below;
+			below = tmp;
+		} else {
+			grid1 = tmp;
+		}
+	}
+
+	if (slab->seam[1])
+		mcSaveSeam(grid0, count, slab->seam[1]);
+
+	if (!vol && !grid->stream && !slab->counting)
+		mcCalcNormals(help, grid, field, &batch);
+	goto end;
+
+fail:
+	// Out of memory, or the stream callback stopped us.
+	if (!help->fixed)
+		mcFree(&help->mesh);
+	slab->failed = 1;
+end:
+	mcFreePtr(sliceMem);
+	mcFreePtr(batch.x);
+	mcFreePtr(skip.fill[0]);
+	mcFreePtr(skip.need);
+	mcFreePtr(skip.index);
+}
+
+// Joins the slab meshes together. Slabs share their boundary slices,
+// so the vertices on the bottom slice of each slab are dropped in favour
+// of the ones the slab below made for the same edges.
+MC_STATIC McMesh mcMergeSlabs(McSlab *slabs, int nslabs, int count)
+{
+	McMesh mesh = { 0, 0, NULL, NULL };
+	int maxverts = 0;
+	for (int s=0;s<nslabs;s++)
+	{
+		McMesh *part = &slabs[s].help.mesh;
+		mesh.nverts += part->nverts;
+		mesh.ntris += part->ntris;
+		if (part->nverts > maxverts)
+			maxverts = part->nverts;
+		if (s > 0)
+		{
+			for (int n=0;n<count*2;n++)
+				if (slabs[s].seam[0][n] >= 0)
+					mesh.nverts--;
+		}
+	}
+
+	mesh.verts = (McVertex *)MC_REALLOC(NULL, (mesh.nverts+1) * sizeof(McVertex));
+	mesh.indices = (int *)MC_REALLOC(NULL, (mesh.ntris*3+1) * sizeof(int));
+	int *remap = (int *)MC_REALLOC(NULL, (maxverts+1) * sizeof(int));
+	if (!mesh.verts || !mesh.indices || !remap)
+	{
+		mcFree(&mesh);
+		mcFreePtr(remap);
+		return mesh;
+	}
+
+	int nverts = 0, nindices = 0;
+	for (int s=0;s<nslabs;s++)
+	{
+		McMesh *part = &slabs[s].help.mesh;
+		for (int n=0;n<part->nverts;n++)
+			remap[n] = -1;
+
+		// The top seam of the slab below already holds output indices.
+		if (s > 0)
+		{
+			int *bottom = slabs[s].seam[0];
+			int *below = slabs[s-1].seam[1];
+			for (int n=0;n<count*2;n++)
+				if (bottom[n] >= 0)
+					remap[bottom[n]] = below[n];
+		}
+
+		for (int n=0;n<part->nverts;n++)
+		{
+			if (remap[n] < 0)
+			{
+				remap[n] = nverts;
+				mesh.verts[nverts++] = part->verts[n];
+			}
+		}
+
+		for (int n=0;n<part->ntris*3;n++)
+			mesh.indices[nindices++] = remap[part->indices[n]];
+
+		if (s < nslabs-1)
+		{
+			int *top = slabs[s].seam[1];
+			for (int n=0;n<count*2;n++)
+				if (top[n] >= 0)
+					top[n] = remap[top[n]];
+		}
+	}
+
+	mcFreePtr(remap);
+	mesh.nverts = nverts;
+	return mesh;
+}
+
+// Work for one thread. Slabs are dealt out round-robin, so that
+// threads get a similar mix of busy and empty regions.
+typedef struct {
+	const McGrid *grid;
+	const void *field;
+	McSlab *slabs;
+	int nslabs, first, step;
+} McWork;
+
+MC_FIELD_TEMPLATE static void mcRunWork(void *param)
+{
+	McWork *work = (McWork *)param;
+	for (int s=work->first;s<work->nslabs;s+=work->step)
+		mcGenerateSlab(work->grid, (const McFieldT *)work->field, &work->slabs[s]);
+}
+
+// Sets up a grid of cubic cells covering the bounds.
+MC_STATIC void mcGridFromBounds(McGrid *grid, const float *bmin, const float *bmax, float cellsize)
+{
+	// Calculate cell counts for each axis.
+	float invsize = 1.0f / cellsize;
+	grid->xd = (int)ceilf((bmax[0] - bmin[0]) * invsize);
+	grid->yd = (int)ceilf((bmax[1] - bmin[1]) * invsize);
+	grid->zd = (int)ceilf((bmax[2] - bmin[2]) * invsize);
+	grid->streamed = 0;
+	grid->normals = MC_NORMALS_FIELD;
+	grid->stream = NULL;
+	grid->streamparam = NULL;
+	for (int i=0;i<3;i++)
+	{
+		grid->bmin[i] = bmin[i];
+		grid->cellsize[i] = cellsize;
+	}
+}
+
+// Works out how many threads to use, and how many slabs to split the grid into.
+MC_STATIC int mcSlabCount(const McGrid *grid, int *nthreads)
+{
+	if (*nthreads < 0)
+		*nthreads = mcDefaultThreads();
+	if (!MC_THREADS || *nthreads < 1)
+		*nthreads = 1;
+	if (*nthreads > MC_MAX_THREADS)
+		*nthreads = MC_MAX_THREADS;
+	if (*nthreads > grid->zd)
+		*nthreads = grid->zd;
+	if (*nthreads == 1)
+		return 1;
+
+	// Use a few slabs per thread to even out the load, but not so many
+	// that re-reading the shared boundary slices costs much.
+	int nslabs = *nthreads * MC_SLABS_PER_THREAD;
+	if (nslabs > grid->zd / MC_MIN_SLAB_SLICES)
+		nslabs = grid->zd / MC_MIN_SLAB_SLICES;
+	if (nslabs < *nthreads)
+		nslabs = *nthreads;
+	return nslabs;
+}
+
+MC_STATIC void mcInitSlab(McSlab *slab, const McGrid *grid, int s, int nslabs)
+{
+	slab->z0 = (int)((long long)grid->zd * s / nslabs);
+	slab->z1 = (int)((long long)grid->zd * (s+1) / nslabs);
+	slab->seam[0] = slab->seam[1] = NULL;
+	slab->counting = 0;
+	slab->out = NULL;
+}
+
+// Runs the slabs, using the calling thread as one of the workers.
+MC_FIELD_TEMPLATE static void mcRunSlabs(const McGrid *grid, const McFieldT *field, McSlab *slabs, int nslabs, McWork *work, int nthreads)
+{
+	for (int t=0;t<nthreads;t++)
+	{
+		work[t].grid = grid;
+		work[t].field = field;
+		work[t].slabs = slabs;
+		work[t].nslabs = nslabs;
+		work[t].first = t;
+		work[t].step = nthreads;
+	}
+
+	mcRunThreads(MC_FIELD_FN(mcRunWork), work, sizeof(McWork), nthreads);
+}
+
+MC_FIELD_TEMPLATE static McMesh mcGenerateField(McGrid grid, int nthreads, const McFieldT *field)
+{
+	McMesh mesh = { 0, 0, NULL, NULL };
+	if (grid.xd <= 0 || grid.yd <= 0 || grid.zd <= 0)
+		return mesh;
+
+	grid.batchSize = MC_BATCH_SIZE;
+	if (grid.batchSize < grid.xd+1)
+		grid.batchSize = grid.xd+1;
+
+	// A single thread just does the whole thing in one slab.
+	int nslabs = mcSlabCount(&grid, &nthreads);
+	if (nslabs == 1)
+	{
+		McSlab slab;
+		mcInitSlab(&slab, &grid, 0, 1);
+		mcGenerateSlab(&grid, field, &slab);
+		return slab.help.mesh;
+	}
+
+	int count = (grid.xd+1)*(grid.yd+1);
+	McSlab *slabs = (McSlab *)MC_REALLOC(NULL, nslabs * sizeof(McSlab));
+	int *seams = (int *)MC_REALLOC(NULL, (size_t)nslabs * count * 4 * sizeof(int));
+	McWork *work = (McWork *)MC_REALLOC(NULL, nthreads * sizeof(McWork));
+	if (!slabs || !seams || !work)
+		goto end;
+
+	for (int s=0;s<nslabs;s++)
+	{
+		mcInitSlab(&slabs[s], &grid, s, nslabs);
+		slabs[s].seam[0] = seams + (size_t)count*4*s;
+		slabs[s].seam[1] = slabs[s].seam[0] + count*2;
+	}
+
+	MC_FIELD_FN(mcRunSlabs)(&grid, field, slabs, nslabs, work, nthreads);
+
+	{
+		int failed = 0;
+		for (int s=0;s<nslabs;s++)
+			failed |= slabs[s].failed;
+		if (!failed)
+			mesh = mcMergeSlabs(slabs, nslabs, count);
+	}
+
+	for (int s=0;s<nslabs;s++)
+		mcFree(&slabs[s].help.mesh);
+
+end:
+	mcFreePtr(slabs);
+	mcFreePtr(seams);
+	mcFreePtr(work);
+	return mesh;
+}
+
+// What mcGenerateExact does with the mesh.
+#define MC_EXACT_COUNT	0	// just count it
+#define MC_EXACT_ALLOC	1	// allocate arrays to fit, and make it
+#define MC_EXACT_INTO	2	// make it in the arrays given, if it fits
+
+// Makes the mesh in two passes: the slabs count what they'll make, and
+// then write it straight into the arrays at offsets from those counts,
+// so there's no growing or merging. Returns 0 if out of memory, or if
+// the arrays given were too small. (leaving the counts it needed)
+MC_FIELD_TEMPLATE static int mcGenerateExact(McGrid grid, int nthreads, const McFieldT *field, McMesh *mesh, int mode)
+{
+	int maxverts = mesh->nverts, maxtris = mesh->ntris;
+	mesh->nverts = 0;
+	mesh->ntris = 0;
+	if (grid.xd <= 0 || grid.yd <= 0 || grid.zd <= 0)
+		return 1;
+
+	grid.batchSize = MC_BATCH_SIZE;
+	if (grid.batchSize < grid.xd+1)
+		grid.batchSize = grid.xd+1;
+
+	int ok = 0;
+	int nslabs = mcSlabCount(&grid, &nthreads);
+	McSlab *slabs = (McSlab *)MC_REALLOC(NULL, nslabs * sizeof(McSlab));
+	McWork *work = (McWork *)MC_REALLOC(NULL, nthreads * sizeof(McWork));
+	if (!slabs || !work)
+		goto end;
+
+	// Count, and give each slab its range of the output.
+	for (int s=0;s<nslabs;s++)
+	{
+		mcInitSlab(&slabs[s], &grid, s, nslabs);
+		slabs[s].counting = 1;
+	}
+	MC_FIELD_FN(mcRunSlabs)(&grid, field, slabs, nslabs, work, nthreads);
+	for (int s=0;s<nslabs;s++)
+	{
+		if (slabs[s].failed)
+			goto end;
+		slabs[s].vbase = mesh->nverts;
+		slabs[s].tbase = mesh->ntris;
+		mesh->nverts += slabs[s].nverts;
+		mesh->ntris += slabs[s].ntris;
+	}
+	if (mode == MC_EXACT_COUNT)
+	{
+		ok = 1;
+		goto end;
+	}
+
+	if (mode == MC_EXACT_ALLOC)
+	{
+		mesh->verts = (McVertex *)MC_REALLOC(NULL, (mesh->nverts+1) * sizeof(McVertex));
+		mesh->indices = (int *)MC_REALLOC(NULL, (mesh->ntris*3+1) * sizeof(int));
+		if (!mesh->verts || !mesh->indices)
+		{
+			mcFree(mesh);
+			goto end;
+		}
+	} else if (mesh->nverts > maxverts || mesh->ntris > maxtris) {
+		goto end;
+	}
+
+	// Make it.
+	for (int s=0;s<nslabs;s++)
+	{
+		slabs[s].counting = 0;
+		slabs[s].out = mesh;
+		slabs[s].topBase = s+1 < nslabs ? slabs[s+1].vbase : -1;
+	}
+	MC_FIELD_FN(mcRunSlabs)(&grid, field, slabs, nslabs, work, nthreads);
+	ok = 1;
+	for (int s=0;s<nslabs;s++)
+		ok &= !slabs[s].failed;
+	if (!ok && mode == MC_EXACT_ALLOC)
+		mcFree(mesh);
+
+end:
+	mcFreePtr(slabs);
+	mcFreePtr(work);
+	return ok;
+}
+
+#ifdef __cplusplus
+template<class Fn>
+static inline McMesh mcGenerateT(const float *bmin, const float *bmax, float cellsize, Fn fn, int threads)
+{
+	McGrid grid;
+	mcGridFromBounds(&grid, bmin, bmax, cellsize);
+	return mcGenerateField(grid, threads, &fn);
+}
+#endif
+
+#endif // MC_IMPLEMENTATION || MC_TEMPLATE
+
+#ifdef MC_IMPLEMENTATION
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif MC_THREADS
+#include <pthread.h>
+#endif
+
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MC_MMAP 1
+#else
+#define MC_MMAP 0
+#endif
+
+int mcDefaultThreads(void)
+{
+#if MC_THREADS && defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+#elif MC_THREADS && defined(_SC_NPROCESSORS_ONLN)
+	return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+	return 1;
+#endif
+}
+
+#if MC_THREADS
+typedef struct {
+	void (*fn)(void *);
+	void *param;
+} McThread;
+
+#ifdef _WIN32
+static DWORD WINAPI mcThreadProc(LPVOID param)
+{
+	McThread *thread = (McThread *)param;
+	thread->fn(thread->param);
+	return 0;
+}
+#else
+static void *mcThreadProc(void *param)
+{
+	McThread *thread = (McThread *)param;
+	thread->fn(thread->param);
+	return NULL;
+}
+#endif
+#endif
+
+// Calls fn on each of count items, spaced itemSize bytes apart, with
+// the calling thread doing the first.
+void mcRunThreads(void (*fn)(void *), void *items, size_t itemSize, int count)
+{
+	char *item = (char *)items;
+#if MC_THREADS
+	McThread params[MC_MAX_THREADS];
+#ifdef _WIN32
+	HANDLE threads[MC_MAX_THREADS];
+#else
+	pthread_t threads[MC_MAX_THREADS];
+#endif
+	int nstarted = 0;
+	for (int t=1;t<count;t++,nstarted++)
+	{
+		params[nstarted].fn = fn;
+		params[nstarted].param = item + itemSize*t;
+#ifdef _WIN32
+		threads[nstarted] = CreateThread(NULL, 0, mcThreadProc, &params[nstarted], 0, NULL);
+		if (!threads[nstarted])
+			break;
+#else
+		if (pthread_create(&threads[nstarted], NULL, mcThreadProc, &params[nstarted]) != 0)
+			break;
+#endif
+	}
+
+	// Any threads we couldn't start get run here instead.
+	fn(item);
+	for (int t=nstarted+1;t<count;t++)
+		fn(item + itemSize*t);
+
+	for (int t=0;t<nstarted;t++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(threads[t], INFINITE);
+		CloseHandle(threads[t]);
+#else
+		pthread_join(threads[t], NULL);
+#endif
+	}
+#else
+	for (int t=0;t<count;t++)
+		fn(item + itemSize*t);
+#endif
+}
+
+// Tells the OS which slices of a memory-mapped volume we'll want soon
+// (willNeed), or are done with, so only a few stay resident.
+void mcVolumeHint(const McVolume *vol, int z0, int z1, int willNeed)
+{
+#if MC_MMAP && defined(MADV_WILLNEED) && defined(MADV_DONTNEED)
+	if (z0 < 0)
+		z0 = 0;
+	if (z1 > vol->size[2])
+		z1 = vol->size[2];
+	if (z0 >= z1)
+		return;
+
+	size_t sliceBytes = (size_t)vol->stride[2] * mcVolumeSampleBytes(vol->type);
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)vol->data + z0*sliceBytes;
+	uintptr_t end = (uintptr_t)vol->data + z1*sliceBytes;
+	if (willNeed)
+		start &= ~(page-1);
+	else {
+		// Only drop pages that are entirely ours.
+		start = (start + page-1) & ~(page-1);
+		end &= ~(page-1);
+	}
+	if (end > start)
+		madvise((void *)start, end - start, willNeed ? MADV_WILLNEED : MADV_DONTNEED);
+#else
+	(void)vol; (void)z0; (void)z1; (void)willNeed;
+#endif
+}
+
+
+McMesh mcGenerateEx(const float *bmin, const float *bmax, float cellsize, const McConfig *config)
+{
+	McFieldC field = { config->fn, config->batchFn, config->gradFn, config->boundFn, config->lipschitz, config->userparam, NULL };
+	McGrid grid;
+	mcGridFromBounds(&grid, bmin, bmax, cellsize);
+	grid.normals = config->normals;
+	if (config->exact)
+	{
+		McMesh mesh = { 0, 0, NULL, NULL };
+		mcGenerateExact(grid, config->threads, &field, &mesh, MC_EXACT_ALLOC);
+		return mesh;
+	}
+	return mcGenerateField(grid, config->threads, &field);
+}
+
+int mcCountEx(const float *bmin, const float *bmax, float cellsize, const McConfig *config, int *nverts, int *ntris)
+{
+	McFieldC field = { config->fn, config->batchFn, config->gradFn, config->boundFn, config->lipschitz, config->userparam, NULL };
+	McGrid grid;
+	mcGridFromBounds(&grid, bmin, bmax, cellsize);
+	grid.normals = config->normals;
+	McMesh mesh = { 0, 0, NULL, NULL };
+	int ok = mcGenerateExact(grid, config->threads, &field, &mesh, MC_EXACT_COUNT);
+	*nverts = mesh.nverts;
+	*ntris = mesh.ntris;
+	return ok;
+}
+
+int mcGenerateInto(const float *bmin, const float *bmax, float cellsize, const McConfig *config, McMesh *mesh)
+{
+	McFieldC field = { config->fn, config->batchFn, config->gradFn, config->boundFn, config->lipschitz, config->userparam, NULL };
+	McGrid grid;
+	mcGridFromBounds(&grid, bmin, bmax, cellsize);
+	grid.normals = config->normals;
+	return mcGenerateExact(grid, config->threads, &field, mesh, MC_EXACT_INTO);
+}
+
+// Makes the mesh in one slab on the calling thread,
+// passing it to the grid's stream callback as it goes.
+static int mcStreamField(McGrid grid, const McFieldC *field)
+{
+	if (grid.xd <= 0 || grid.yd <= 0 || grid.zd <= 0)
+		return 1;
+	grid.batchSize = MC_BATCH_SIZE;
+	if (grid.batchSize < grid.xd+1)
+		grid.batchSize = grid.xd+1;
+
+	McSlab slab;
+	mcInitSlab(&slab, &grid, 0, 1);
+	mcGenerateSlab(&grid, field, &slab);
+	if (slab.failed)
+		return 0;
+	mcFree(&slab.help.mesh);
+	return 1;
+}
+
+static void mcVolumeGrid(McGrid *grid, const McVolume *volume, int streamed)
+{
+	grid->xd = volume->size[0]-1;
+	grid->yd = volume->size[1]-1;
+	grid->zd = volume->size[2]-1;
+	for (int i=0;i<3;i++)
+	{
+		grid->bmin[i] = volume->origin[i];
+		grid->cellsize[i] = volume->spacing[i];
+	}
+	grid->streamed = streamed;
+	grid->normals = MC_NORMALS_GRID;
+	grid->stream = NULL;
+	grid->streamparam = NULL;
+}
+
+// With normals set to MC_NORMALS_FIELD, the normals are left for you.
+static McMesh mcGenerateVolume(const McVolume *volume, int threads, int streamed, int normals)
+{
+	McFieldC field = { NULL, NULL, NULL, NULL, 0, NULL, volume };
+	McGrid grid;
+	mcVolumeGrid(&grid, volume, streamed);
+	grid.normals = normals;
+	return mcGenerateField(grid, threads, &field);
+}
+
+// Streams a volume's mesh instead, if stream is set.
+static int mcStreamVolume(const McVolume *volume, int streamed, McStreamFn *stream, void *streamparam)
+{
+	McFieldC field = { NULL, NULL, NULL, NULL, 0, NULL, volume };
+	McGrid grid;
+	mcVolumeGrid(&grid, volume, streamed);
+	grid.stream = stream;
+	grid.streamparam = streamparam;
+	return mcStreamField(grid, &field);
+}
+
+McMesh mcGenerateFromGrid(const McVolume *volume, int threads)
+{
+	return mcGenerateVolume(volume, threads, 0, MC_NORMALS_GRID);
+}
+
+// Maps the file and meshes it, either into mesh or out through stream.
+static int mcFileVolume(const char *path, size_t offset, const McVolume *layout, int threads, McStreamFn *stream, void *streamparam, McMesh *mesh)
+{
+	int ok = 0;
+	McVolume vol = *layout;
+	vol.stride[0] = 1;
+	vol.stride[1] = vol.size[0];
+	vol.stride[2] = vol.size[0] * vol.size[1];
+	size_t bytes = offset + (size_t)vol.stride[2] * vol.size[2] * mcVolumeSampleBytes(vol.type);
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return ok;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = NULL;
+	const void *base = NULL;
+	if (GetFileSizeEx(file, &fileSize) && (unsigned long long)fileSize.QuadPart >= bytes)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping)
+		base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (base)
+	{
+		vol.data = (const char *)base + offset;
+		if (stream) {
+			ok = mcStreamVolume(&vol, 1, stream, streamparam);
+		} else {
+			*mesh = mcGenerateVolume(&vol, threads, 1, MC_NORMALS_GRID);
+			ok = 1;
+		}
+		UnmapViewOfFile(base);
+	}
+	if (mapping)
+		CloseHandle(mapping);
+	CloseHandle(file);
+#elif MC_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return ok;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (unsigned long long)st.st_size >= bytes)
+	{
+		void *base = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		if (base != MAP_FAILED)
+		{
+#ifdef MADV_SEQUENTIAL
+			madvise(base, bytes, MADV_SEQUENTIAL);
+#endif
+			vol.data = (const char *)base + offset;
+			if (stream) {
+				ok = mcStreamVolume(&vol, 1, stream, streamparam);
+			} else {
+				*mesh = mcGenerateVolume(&vol, threads, 1, MC_NORMALS_GRID);
+				ok = 1;
+			}
+			munmap(base, bytes);
+		}
+	}
+	close(fd);
+#else
+	(void)path; (void)bytes; (void)threads; (void)stream; (void)streamparam; (void)mesh;
+#endif
+	return ok;
+}
+
+McMesh mcGenerateFromFile(const char *path, size_t offset, const McVolume *layout, int threads)
+{
+	McMesh mesh = { 0, 0, NULL, NULL };
+	mcFileVolume(path, offset, layout, threads, NULL, NULL, &mesh);
+	return mesh;
+}
+
+int mcStreamEx(const float *bmin, const float *bmax, float cellsize, const McConfig *config, McStreamFn *stream, void *streamparam)
+{
+	McFieldC field = { config->fn, config->batchFn, config->gradFn, config->boundFn, config->lipschitz, config->userparam, NULL };
+	McGrid grid;
+	mcGridFromBounds(&grid, bmin, bmax, cellsize);
+	grid.normals = config->normals;
+	grid.stream = stream;
+	grid.streamparam = streamparam;
+	return mcStreamField(grid, &field);
+}
+
+int mcStreamFromGrid(const McVolume *volume, McStreamFn *stream, void *streamparam)
+{
+	return mcStreamVolume(volume, 0, stream, streamparam);
+}
+
+int mcStreamFromFile(const char *path, size_t offset, const McVolume *layout, McStreamFn *stream, void *streamparam)
+{
+	return mcFileVolume(path, offset, layout, 1, stream, streamparam, NULL);
+}
+
+// Corners of a cell, and the corners at the ends of each edge,
+// in the order mcEdgeTable and mcTriTable use.
+static const int mcCubeCorners[8][3] = {
+	{0,0,0}, {1,0,0}, {1,1,0}, {0,1,0}, {0,0,1}, {1,0,1}, {1,1,1}, {0,1,1} };
+static const int mcCubeEdges[12][2] = {
+	{0,1}, {1,2}, {3,2}, {0,3}, {4,5}, {5,6}, {7,6}, {4,7}, {0,4}, {1,5}, {2,6}, {3,7} };
+
+// The sides of a square on a cell face, from (i,j) to (i,j), and
+// whether each runs along the face's first axis.
+static const int mcSquareSides[4][5] = {
+	{0,0, 1,0, 1}, {1,0, 1,1, 0}, {0,1, 1,1, 1}, {0,0, 0,1, 0} };
+
+// Fills in the normals (if asked) and extra data of a finished mesh
+// by calling the field at each vertex, for meshes that weren't made
+// by the slab code.
+static void mcFieldVertices(McMesh *mesh, const McFieldC *field, float epsilon, int normals)
+{
+	for (int n=0;n<mesh->nverts;n++)
+	{
+		McVertex *v = &mesh->verts[n];
+		float extra[MC_EXTRA_DATA+1];
+		if (field->gradFn)
+		{
+			float grad[3];
+			field->gradFn(&v->x, grad, extra, field->userparam);
+			mcSetNormal(v, grad[0], grad[1], grad[2]);
+		} else if (normals) {
+			float v1[3] = { v->x - epsilon, v->y, v->z };
+			float v2[3] = { v->x, v->y - epsilon, v->z };
+			float v3[3] = { v->x, v->y, v->z - epsilon };
+			float f1 = mcCallFieldC(field, v1, extra);
+			float f2 = mcCallFieldC(field, v2, extra);
+			float f3 = mcCallFieldC(field, v3, extra);
+			float f0 = mcCallFieldC(field, &v->x, extra);
+			mcSetNormal(v, f0 - f1, f0 - f2, f0 - f3);
+		} else {
+			mcCallFieldC(field, &v->x, extra);
+		}
+#if MC_EXTRA_DATA > 0
+		for (int i=0;i<MC_EXTRA_DATA;i++)
+			v->extra[i] = extra[i];
+#endif
+	}
+}
+
+// Samples points x0 to x0+count-1 of a row along X that starts at pos,
+// leaving out any that skip (if set) marks. The batch needs room for
+// 4+MC_EXTRA_DATA floats per point.
+static void mcSampleRow(const McFieldC *field, const float *pos, float step, int x0, int count, const unsigned char *skip, float *values, float *batch)
+{
+	float *bx = batch, *by = batch + count, *bz = batch + count*2, *bv = batch + count*3;
+	int n = 0;
+	for (int x=0;x<count;x++)
+	{
+		if (skip && skip[x])
+			continue;
+		float p[3] = { pos[0] + step*(x0 + x), pos[1], pos[2] };
+		if (field->batchFn)
+		{
+			bx[n] = p[0];
+			by[n] = p[1];
+			bz[n] = p[2];
+			n++;
+		} else {
+			float extra[MC_EXTRA_DATA+1];
+			values[x] = mcCallFieldC(field, p, extra);
+		}
+	}
+	if (!n)
+		return;
+	field->batchFn(n, bx, by, bz, bv, bv + count, field->userparam);
+	for (int x=0,i=0;x<count;x++)
+		if (!(skip && skip[x]))
+			values[x] = bv[i++];
+}
+
+//--- Adaptive grids ------------------------------------------------------
+
+// A cube in an adaptive grid, in units of the finest cells.
+typedef struct {
+	int x, y, z, size;
+	int child;		// first of its 8 children, or -1 for a leaf
+} McNode;
+
+// Maps packed lattice keys to indices, with open addressing.
+typedef struct {
+	uint64_t *keys;
+	int *values;
+	int size, count;
+} McHash;
+
+#define MC_HASH_EMPTY	(~(uint64_t)0)
+#define MC_LATTICE_BITS	19
+
+typedef struct {
+	McFieldC field;
+	McRefineFn *refine;
+	float bmin[3];
+	float cellsize;
+	int roots[3];			// root cubes along each axis
+	McNode *nodes;			// the roots come first, X fastest
+	int nnodes, maxnodes;
+	McHash samples;			// field samples, by lattice point
+	float *values;
+	int nvalues, maxvalues;
+	McHash verts;			// mesh vertices, by the line they lie on
+	McHelper help;
+	int failed;
+} McAdaptive;
+
+static uint64_t mcLatticeKey(int x, int y, int z, int tag)
+{
+	return ((uint64_t)x << (64 - MC_LATTICE_BITS))
+		| ((uint64_t)y << (64 - MC_LATTICE_BITS*2))
+		| ((uint64_t)z << (64 - MC_LATTICE_BITS*3))
+		| (uint64_t)tag;
+}
+
+// Finds the value slot for a key, adding it (as -1) if it's new.
+static int *mcHashSlot(McHash *hash, uint64_t key)
+{
+	if (hash->count*2 >= hash->size)
+	{
+		// Grow and re-insert.
+		McHash old = *hash;
+		hash->size = old.size ? old.size*2 : 4096;
+		hash->count = 0;
+		hash->keys = (uint64_t *)MC_REALLOC(NULL, sizeof(uint64_t) * hash->size);
+		hash->values = (int *)MC_REALLOC(NULL, sizeof(int) * hash->size);
+		if (!hash->keys || !hash->values)
+		{
+			// Keep the old tables, so the hash can still be freed as usual.
+			mcFreePtr(hash->keys);
+			mcFreePtr(hash->values);
+			*hash = old;
+			return NULL;
+		}
+		for (int i=0;i<hash->size;i++)
+			hash->keys[i] = MC_HASH_EMPTY;
+		for (int i=0;i<old.size;i++)
+			if (old.keys[i] != MC_HASH_EMPTY)
+				*mcHashSlot(hash, old.keys[i]) = old.values[i];
+		mcFreePtr(old.keys);
+		mcFreePtr(old.values);
+	}
+
+	int mask = hash->size-1;
+	int i = (int)((key * 0x9E3779B97F4A7C15ull) >> 40) & mask;
+	while (hash->keys[i] != key)
+	{
+		if (hash->keys[i] == MC_HASH_EMPTY)
+		{
+			hash->keys[i] = key;
+			hash->values[i] = -1;
+			hash->count++;
+			break;
+		}
+		i = (i+1) & mask;
+	}
+	return &hash->values[i];
+}
+
+static void mcLatticePos(const McAdaptive *a, const int *p, float *pos)
+{
+	for (int i=0;i<3;i++)
+		pos[i] = a->bmin[i] + a->cellsize*p[i];
+}
+
+// Samples the field at a lattice point (just once).
+static float mcAdaptiveSample(McAdaptive *a, const int *p)
+{
+	int *slot = mcHashSlot(&a->samples, mcLatticeKey(p[0], p[1], p[2], 0));
+	if (!slot)
+	{
+		a->failed = 1;
+		return 0;
+	}
+	if (*slot >= 0)
+		return a->values[*slot];
+
+	if (a->nvalues >= a->maxvalues)
+	{
+		// (the old array is kept on failure, as the build carries on)
+		int maxvalues = a->maxvalues ? a->maxvalues*2 : 4096;
+		float *values = (float *)MC_REALLOC(a->values, sizeof(float) * maxvalues);
+		if (!values)
+		{
+			a->failed = 1;
+			return 0;
+		}
+		a->values = values;
+		a->maxvalues = maxvalues;
+	}
+	float pos[3], extra[MC_EXTRA_DATA+1];
+	mcLatticePos(a, p, pos);
+	float value = mcCallFieldC(&a->field, pos, extra);
+	a->values[a->nvalues] = value;
+	*slot = a->nvalues++;
+	return value;
+}
+
+// Finds the leaf containing a point given in half-cell units.
+static const McNode *mcFindLeaf(const McAdaptive *a, const int *q)
+{
+	int root[3];
+	int size = a->nodes[0].size;
+	for (int i=0;i<3;i++)
+	{
+		if (q[i] < 0)
+			return NULL;
+		root[i] = q[i] / (size*2);
+		if (root[i] >= a->roots[i])
+			return NULL;
+	}
+
+	const McNode *node = &a->nodes[(root[2]*a->roots[1] + root[1])*a->roots[0] + root[0]];
+	while (node->child >= 0)
+	{
+		int half = node->size;	// (half the size, in half-cell units)
+		int c = (q[0] >= node->x*2 + half ? 1 : 0)
+			  | (q[1] >= node->y*2 + half ? 2 : 0)
+			  | (q[2] >= node->z*2 + half ? 4 : 0);
+		node = &a->nodes[node->child + c];
+	}
+	return node;
+}
+
+// Finds the leaf just across one face of a cell, from the face's centre.
+static const McNode *mcFindNeighbour(const McAdaptive *a, const McNode *node, int axis, int side)
+{
+	const int *lo = &node->x;
+	int q[3] = { lo[0]*2 + node->size, lo[1]*2 + node->size, lo[2]*2 + node->size };
+	q[axis] = side ? (lo[axis] + node->size)*2 + 1 : lo[axis]*2 - 1;
+	return mcFindLeaf(a, q);
+}
+
+// Gets the field value at a lattice point. Points that lie partway along
+// the edge or face of a bigger cell take its interpolated value instead
+// of a real sample, so that the smaller cells there see the same surface
+// the bigger cell does.
+static float mcAdaptiveValue(McAdaptive *a, const int *p)
+{
+	// Find the biggest leaf touching it that doesn't have it as a corner.
+	const McNode *best = NULL;
+	for (int k=0;k<8;k++)
+	{
+		int q[3] = { p[0]*2 + ((k & 1) ? 1 : -1), p[1]*2 + ((k & 2) ? 1 : -1), p[2]*2 + ((k & 4) ? 1 : -1) };
+		const McNode *node = mcFindLeaf(a, q);
+		if (!node || (best && node->size <= best->size))
+			continue;
+		if ((p[0] == node->x || p[0] == node->x + node->size)
+		 && (p[1] == node->y || p[1] == node->y + node->size)
+		 && (p[2] == node->z || p[2] == node->z + node->size))
+			continue;
+		best = node;
+	}
+	if (!best)
+		return mcAdaptiveSample(a, p);
+
+	// Interpolate across its edge or face.
+	const int *lo = &best->x;
+	float frac[3];
+	int axes[2], naxes = 0;
+	for (int i=0;i<3;i++)
+	{
+		frac[i] = (float)(p[i] - lo[i]) / best->size;
+		if (p[i] != lo[i] && p[i] != lo[i] + best->size)
+			axes[naxes++] = i;
+	}
+
+	float value = 0;
+	for (int k=0;k<(1 << naxes);k++)
+	{
+		int c[3] = { p[0], p[1], p[2] };
+		float w = 1;
+		for (int n=0;n<naxes;n++)
+		{
+			int i = axes[n];
+			c[i] = lo[i] + ((k >> n) & 1 ? best->size : 0);
+			w *= (k >> n) & 1 ? frac[i] : 1-frac[i];
+		}
+		value += w * mcAdaptiveValue(a, c);
+	}
+	return value;
+}
+
+static int mcAdaptiveSplit(McAdaptive *a, int index)
+{
+	if (a->nnodes + 8 > a->maxnodes)
+	{
+		int maxnodes = a->maxnodes*2 + 8;
+		McNode *nodes = (McNode *)MC_REALLOC(a->nodes, sizeof(McNode) * maxnodes);
+		if (!nodes)
+		{
+			a->failed = 1;
+			return 0;
+		}
+		a->nodes = nodes;
+		a->maxnodes = maxnodes;
+	}
+
+	McNode *node = &a->nodes[index];
+	int half = node->size / 2;
+	node->child = a->nnodes;
+	for (int c=0;c<8;c++)
+	{
+		McNode *child = &a->nodes[a->nnodes++];
+		child->x = node->x + ((c & 1) ? half : 0);
+		child->y = node->y + ((c & 2) ? half : 0);
+		child->z = node->z + ((c & 4) ? half : 0);
+		child->size = half;
+		child->child = -1;
+	}
+	return 1;
+}
+
+// Splits a cell (and its children) for as long as the surface might
+// be in it, and the refine callback wants it split.
+static void mcAdaptiveBuild(McAdaptive *a, int index)
+{
+	McNode node = a->nodes[index];
+	if (node.size <= 1 || a->failed)
+		return;
+
+	float bmin[3], bmax[3];
+	mcLatticePos(a, &node.x, bmin);
+	for (int i=0;i<3;i++)
+		bmax[i] = bmin[i] + a->cellsize*node.size;
+
+	if (mcHasBound(&a->field))
+	{
+		float lo, hi;
+		mcCallBound(&a->field, bmin, bmax, &lo, &hi);
+		if (lo > 0 || hi < 0)
+			return;
+	} else {
+		int signs = 0;
+		for (int k=0;k<8;k++)
+		{
+			int c[3] = { node.x + ((k & 1) ? node.size : 0), node.y + ((k & 2) ? node.size : 0), node.z + ((k & 4) ? node.size : 0) };
+			signs |= 1 << mcSignBit(mcAdaptiveSample(a, c));
+		}
+		if (signs != 3)
+			return;
+	}
+
+	if (!a->refine(bmin, bmax, a->field.userparam) || !mcAdaptiveSplit(a, index))
+		return;
+	int child = a->nodes[index].child;
+	for (int c=0;c<8;c++)
+		mcAdaptiveBuild(a, child + c);
+}
+
+// The lattice points of a face of a cell at half-size steps, indexed [v][u].
+static void mcFacePoints(const McNode *node, int axis, int side, int points[3][3][3], int *u, int *v)
+{
+	*u = (axis+1) % 3;
+	*v = (axis+2) % 3;
+	for (int j=0;j<3;j++)
+	{
+		for (int i=0;i<3;i++)
+		{
+			int *p = points[j][i];
+			p[0] = node->x;
+			p[1] = node->y;
+			p[2] = node->z;
+			p[axis] += side ? node->size : 0;
+			p[*u] += i*node->size/2;
+			p[*v] += j*node->size/2;
+		}
+	}
+}
+
+// Makes neighbouring leaves differ by at most one size, and splits any
+// cell that meets smaller ones on a face with an ambiguous sign pattern
+// (which can't be stitched), until nothing changes.
+static void mcAdaptiveBalance(McAdaptive *a)
+{
+	int changed = 1;
+	while (changed && !a->failed)
+	{
+		changed = 0;
+		for (int n=0;n<a->nnodes && !a->failed;n++)
+		{
+			if (a->nodes[n].child >= 0)
+				continue;
+			McNode node = a->nodes[n];
+			for (int f=0;f<6;f++)
+			{
+				const McNode *across = mcFindNeighbour(a, &node, f >> 1, f & 1);
+				if (across && across->size > node.size*2)
+				{
+					if (!mcAdaptiveSplit(a, (int)(across - a->nodes)))
+						return;
+					changed = 1;
+				}
+			}
+
+			for (int f=0;f<6;f++)
+			{
+				const McNode *across = mcFindNeighbour(a, &node, f >> 1, f & 1);
+				if (!across || across->size >= node.size)
+					continue;
+				int points[3][3][3], u, v;
+				mcFacePoints(&node, f >> 1, f & 1, points, &u, &v);
+				int s00 = mcSignBit(mcAdaptiveValue(a, points[0][0]));
+				int s10 = mcSignBit(mcAdaptiveValue(a, points[0][2]));
+				int s01 = mcSignBit(mcAdaptiveValue(a, points[2][0]));
+				int s11 = mcSignBit(mcAdaptiveValue(a, points[2][2]));
+				if (s00 == s11 && s10 == s01 && s00 != s10)
+				{
+					if (!mcAdaptiveSplit(a, n))
+						return;
+					changed = 1;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// Gets the vertex where the surface crosses a cell edge. The field is
+// linear along the edge (or face) of the biggest cell touching it, so the
+// vertex is placed and shared by that, which keeps cells of different
+// sizes in agreement.
+static int mcAdaptiveVertex(McAdaptive *a, const int *p, int axis, int len)
+{
+	int u = (axis+1) % 3, v = (axis+2) % 3;
+	int start = p[axis], size = len;
+	for (int k=0;k<4;k++)
+	{
+		int q[3];
+		q[axis] = p[axis]*2 + len;
+		q[u] = p[u]*2 + ((k & 1) ? 1 : -1);
+		q[v] = p[v]*2 + ((k & 2) ? 1 : -1);
+		const McNode *node = mcFindLeaf(a, q);
+		if (node && node->size > size)
+		{
+			size = node->size;
+			start = (&node->x)[axis];
+		}
+	}
+
+	int shift = 0;
+	while ((1 << shift) < size)
+		shift++;
+	int c0[3] = { p[0], p[1], p[2] };
+	c0[axis] = start;
+	int *slot = mcHashSlot(&a->verts, mcLatticeKey(c0[0], c0[1], c0[2], axis << 5 | shift));
+	if (!slot)
+	{
+		a->failed = 1;
+		return 0;
+	}
+	if (*slot >= 0)
+		return *slot;
+
+	McHelper *help = &a->help;
+	int vtxidx = help->mesh.nverts;
+	if (vtxidx >= help->maxverts) {
+		int maxverts = help->maxverts ? help->maxverts * 2 : 4096;
+		McVertex *verts = (McVertex *)MC_REALLOC(help->mesh.verts, maxverts*sizeof(McVertex));
+		if (verts == NULL)
+		{
+			a->failed = 1;
+			return 0;
+		}
+		help->mesh.verts = verts;
+		help->maxverts = maxverts;
+	}
+	help->mesh.nverts++;
+
+	// Get field intersection.
+	int c1[3] = { c0[0], c0[1], c0[2] };
+	c1[axis] += size;
+	float v0 = mcAdaptiveValue(a, c0);
+	float v1 = mcAdaptiveValue(a, c1);
+	float w = v0 - v1;
+	float t = 0;
+	if (fabsf(w) > 0.000001f)
+		t = v0 / w;
+
+	McVertex *vtx = &help->mesh.verts[vtxidx];
+	mcLatticePos(a, c0, &vtx->x);
+	(&vtx->x)[axis] += t * size * a->cellsize;
+	*slot = vtxidx;
+	return vtxidx;
+}
+
+// Triangulates a leaf. Where it meets smaller cells, the triangle edge
+// lying on that face is replaced by a fan out to the path the smaller
+// cells' surface takes across it.
+static void mcAdaptiveCell(McAdaptive *a, const McNode *node)
+{
+	int corners = 0;
+	int pos[8][3];
+	for (int k=0;k<8;k++)
+	{
+		for (int i=0;i<3;i++)
+			pos[k][i] = (&node->x)[i] + mcCubeCorners[k][i]*node->size;
+		corners |= mcSignBit(mcAdaptiveValue(a, pos[k])) << k;
+	}
+	int edges = mcEdgeTable[corners];
+	if (!edges)
+		return;
+
+	int verts[12];
+	for (int e=0;e<12;e++)
+	{
+		if (!(edges & (1 << e)))
+			continue;
+		const int *p0 = pos[mcCubeEdges[e][0]], *p1 = pos[mcCubeEdges[e][1]];
+		int axis = p0[0] != p1[0] ? 0 : p0[1] != p1[1] ? 1 : 2;
+		verts[e] = mcAdaptiveVertex(a, p0, axis, node->size);
+	}
+
+	int tris[64][3], ntris = 0;
+	const char *tcode = mcTriTable[corners];
+	for (int i=0;tcode[i]>=0;i+=3)
+	{
+		tris[ntris][0] = verts[(int)tcode[i]];
+		tris[ntris][1] = verts[(int)tcode[i+2]];
+		tris[ntris][2] = verts[(int)tcode[i+1]];
+		ntris++;
+	}
+
+	for (int f=0;f<6;f++)
+	{
+		const McNode *across = mcFindNeighbour(a, node, f >> 1, f & 1);
+		if (!across || across->size >= node->size)
+			continue;
+
+		int points[3][3][3], u, v;
+		float values[3][3];
+		mcFacePoints(node, f >> 1, f & 1, points, &u, &v);
+		for (int j=0;j<3;j++)
+			for (int i=0;i<3;i++)
+				values[j][i] = mcAdaptiveValue(a, points[j][i]);
+
+		// The segments the smaller cells make across the face,
+		// one per quarter at most.
+		int segs[4][2], nsegs = 0, ok = 1;
+		for (int j=0;j<2;j++)
+		{
+			for (int i=0;i<2;i++)
+			{
+				int found[4], nfound = 0;
+				for (int k=0;k<4;k++)
+				{
+					int i0 = i + mcSquareSides[k][0], j0 = j + mcSquareSides[k][1];
+					int i1 = i + mcSquareSides[k][2], j1 = j + mcSquareSides[k][3];
+					if (mcSignBit(values[j0][i0]) != mcSignBit(values[j1][i1]))
+						found[nfound++] = mcAdaptiveVertex(a, points[j0][i0], mcSquareSides[k][4] ? u : v, node->size/2);
+				}
+				if (nfound == 2)
+				{
+					segs[nsegs][0] = found[0];
+					segs[nsegs][1] = found[1];
+					nsegs++;
+				} else if (nfound) {
+					ok = 0;
+				}
+			}
+		}
+		if (!ok || !nsegs)
+			continue;
+
+		// The cell's own triangles cross the face in one edge, between
+		// two of those segments' ends. Find it and replace it with a fan.
+		for (int t=0;t<ntris;t++)
+		{
+			int e;
+			for (e=0;e<3;e++)
+			{
+				int from = tris[t][e], to = tris[t][(e+1)%3], apex = tris[t][(e+2)%3];
+				int path[8], npath = 1, used = 0;
+				path[0] = from;
+
+				// Walk the segments from one end to the other.
+				while (path[npath-1] != to && npath < 8)
+				{
+					int next = -1;
+					for (int s=0;s<nsegs && next<0;s++)
+					{
+						if (used & (1 << s))
+							continue;
+						if (segs[s][0] == path[npath-1]) next = segs[s][1];
+						else if (segs[s][1] == path[npath-1]) next = segs[s][0];
+						else continue;
+						used |= 1 << s;
+					}
+					if (next < 0)
+						break;
+					path[npath++] = next;
+				}
+				if (path[npath-1] != to || npath <= 2 || ntris + npath-2 > 64)
+					continue;
+
+				tris[t][0] = path[0];
+				tris[t][1] = path[1];
+				tris[t][2] = apex;
+				for (int s=1;s<npath-1;s++)
+				{
+					tris[ntris][0] = path[s];
+					tris[ntris][1] = path[s+1];
+					tris[ntris][2] = apex;
+					ntris++;
+				}
+				break;
+			}
+			if (e < 3)
+				break;
+		}
+	}
+
+	// Write out the triangles.
+	McHelper *help = &a->help;
+	for (int t=0;t<ntris;t++)
+	{
+		int triidx = help->mesh.ntris;
+		if (triidx >= help->maxtris) {
+			int maxtris = help->maxtris ? help->maxtris * 2 : 4096;
+			int *indices = (int *)MC_REALLOC(help->mesh.indices, maxtris*sizeof(int)*3);
+			if (indices == NULL)
+			{
+				a->failed = 1;
+				return;
+			}
+			help->mesh.indices = indices;
+			help->maxtris = maxtris;
+		}
+		help->mesh.ntris++;
+		int *idx = &help->mesh.indices[triidx*3];
+		idx[0] = tris[t][0];
+		idx[1] = tris[t][1];
+		idx[2] = tris[t][2];
+	}
+}
+
+McMesh mcGenerateAdaptive(const float *bmin, const float *bmax, float cellsize, int levels, McRefineFn *refine, const McConfig *config)
+{
+	McMesh empty = { 0, 0, NULL, NULL };
+	McFieldC field = { config->fn, config->batchFn, config->gradFn, config->boundFn, config->lipschitz, config->userparam, NULL };
+	McAdaptive a;
+	McHash none = { NULL, NULL, 0, 0 };
+	a.field = field;
+	a.refine = refine;
+	a.cellsize = cellsize;
+	a.nodes = NULL;
+	a.nnodes = a.maxnodes = 0;
+	a.samples = a.verts = none;
+	a.values = NULL;
+	a.nvalues = a.maxvalues = 0;
+	a.help.mesh = empty;
+	a.help.maxverts = a.help.maxtris = 0;
+	a.failed = 0;
+
+	// Cover the bounds with root cubes.
+	int size = 1 << levels;
+	int nroots = 1;
+	for (int i=0;i<3;i++)
+	{
+		a.bmin[i] = bmin[i];
+		a.roots[i] = (int)ceilf((bmax[i] - bmin[i]) / (cellsize * size));
+		if (a.roots[i] < 1 || (long long)a.roots[i]*size >= (1 << MC_LATTICE_BITS))
+			return empty;
+		nroots *= a.roots[i];
+	}
+	a.maxnodes = nroots + 8;
+	a.nodes = (McNode *)MC_REALLOC(NULL, sizeof(McNode) * a.maxnodes);
+	if (!a.nodes)
+		return empty;
+	for (int z=0;z<a.roots[2];z++)
+	{
+		for (int y=0;y<a.roots[1];y++)
+		{
+			for (int x=0;x<a.roots[0];x++)
+			{
+				McNode *node = &a.nodes[a.nnodes++];
+				node->x = x*size;
+				node->y = y*size;
+				node->z = z*size;
+				node->size = size;
+				node->child = -1;
+			}
+		}
+	}
+
+	for (int n=0;n<nroots;n++)
+		mcAdaptiveBuild(&a, n);
+	mcAdaptiveBalance(&a);
+	for (int n=0;n<a.nnodes && !a.failed;n++)
+	{
+		if (a.nodes[n].child < 0)
+		{
+			McNode node = a.nodes[n];
+			mcAdaptiveCell(&a, &node);
+		}
+	}
+
+	if (!a.failed)
+		mcFieldVertices(&a.help.mesh, &field, cellsize * 0.1f, 1);
+
+	mcFreePtr(a.nodes);
+	mcFreePtr(a.samples.keys);
+	mcFreePtr(a.samples.values);
+	mcFreePtr(a.verts.keys);
+	mcFreePtr(a.verts.values);
+	mcFreePtr(a.values);
+	if (a.failed)
+	{
+		mcFree(&a.help.mesh);
+		return empty;
+	}
+	return a.help.mesh;
+}
+
+//--- Chunks --------------------------------------------------------------
+
+// Gets the index of a sample on a chunk face.
+static int mcChunkIndex(int n, int axis, int plane, int i, int j)
+{
+	int p[3];
+	p[axis] = plane;
+	p[(axis+1) % 3] = i;
+	p[(axis+2) % 3] = j;
+	return (p[2]*n + p[1])*n + p[0];
+}
+
+// Is a point of a chunk's mesh on one of the coarser neighbour's grid
+// lines along an axis? The slab code copies the corner position along
+// the lines, so this is exact.
+static int mcOnCoarseLine(const McVolume *vol, const float *p, int axis)
+{
+	int i = (int)floorf((p[axis] - vol->origin[axis]) / vol->spacing[axis] * 0.5f + 0.5f) * 2;
+	return p[axis] == vol->origin[axis] + vol->spacing[axis]*i;
+}
+
+// Fills in the gaps between a chunk's mesh and a coarser neighbour.
+// Our samples on the face match the neighbour's, so within each of its
+// cells our surface crosses the face along a path that starts and ends
+// where its surface does, but goes straight across. Triangles in the
+// plane of the face join the two up.
+static int mcStitchChunkFace(McMesh *mesh, const McVolume *vol, const float *values, int f, const McFieldC *field)
+{
+	int axis = f >> 1, side = f & 1;
+	int u = (axis+1) % 3, v = (axis+2) % 3;
+	int cells = vol->size[0]-1, n = cells+1, ncells = cells/2;
+	float plane = vol->origin[axis] + vol->spacing[axis] * (side ? cells : 0);
+
+	// Link up the edges our triangles have on the face.
+	int *next = (int *)MC_REALLOC(NULL, sizeof(int) * (mesh->nverts + 1));
+	int *pieces = (int *)MC_REALLOC(NULL, sizeof(int) * (ncells*ncells*2 + 1));
+	int *counts = (int *)MC_REALLOC(NULL, sizeof(int) * (ncells*ncells + 1));
+	int *path = (int *)MC_REALLOC(NULL, sizeof(int) * (mesh->nverts*4 + 16));
+	int *tris = NULL, ntris = 0, maxtris = 0, npath = 0;
+	int failed = !next || !pieces || !counts || !path;
+	if (failed)
+		goto end;
+	for (int i=0;i<mesh->nverts;i++)
+		next[i] = -1;
+	for (int i=0;i<ncells*ncells;i++)
+		counts[i] = 0;
+	for (int t=0;t<mesh->ntris;t++)
+	{
+		const int *idx = &mesh->indices[t*3];
+		for (int e=0;e<3;e++)
+		{
+			int a = idx[e], b = idx[(e+1)%3];
+			if ((&mesh->verts[a].x)[axis] == plane && (&mesh->verts[b].x)[axis] == plane)
+				next[a] = b;
+		}
+	}
+
+	// Split them into pieces between the lines of the neighbour's
+	// cells, and sort them by which of its cells they're in.
+	for (int s=0;s<mesh->nverts;s++)
+	{
+		if (next[s] < 0 || !(mcOnCoarseLine(vol, &mesh->verts[s].x, u) || mcOnCoarseLine(vol, &mesh->verts[s].x, v)))
+			continue;
+
+		// (each piece is stored as its length, then its vertices)
+		int start = npath++, cur = s;
+		path[npath++] = s;
+		for (;;)
+		{
+			cur = next[cur];
+			if (cur < 0 || npath - start > 9)
+				break;
+			path[npath++] = cur;
+			if (mcOnCoarseLine(vol, &mesh->verts[cur].x, u) || mcOnCoarseLine(vol, &mesh->verts[cur].x, v))
+				break;
+		}
+		if (cur < 0 || npath - start > 9)
+		{
+			npath = start;
+			continue;
+		}
+		path[start] = npath - start - 1;
+
+		const float *p0 = &mesh->verts[path[start+1]].x, *p1 = &mesh->verts[path[start+2]].x;
+		int cu = (int)floorf(((p0[u] + p1[u])*0.5f - vol->origin[u]) / vol->spacing[u] * 0.5f);
+		int cv = (int)floorf(((p0[v] + p1[v])*0.5f - vol->origin[v]) / vol->spacing[v] * 0.5f);
+		if (cu < 0 || cv < 0 || cu >= ncells || cv >= ncells || counts[cv*ncells + cu] >= 2)
+			continue;
+		int cell = cv*ncells + cu;
+		pieces[cell*2 + counts[cell]++] = start;
+	}
+
+	for (int cv=0;cv<ncells;cv++)
+	{
+		for (int cu=0;cu<ncells;cu++)
+		{
+			int cell = cv*ncells + cu;
+			if (!counts[cell])
+				continue;
+
+			// See which side of the cell each piece starts and ends on.
+			int ends[2][2];
+			for (int k=0;k<counts[cell];k++)
+			{
+				const int *piece = &path[pieces[cell*2 + k]];
+				for (int e=0;e<2;e++)
+				{
+					const float *p = &mesh->verts[piece[e ? piece[0] : 1]].x;
+					float fu = (p[u] - vol->origin[u]) / vol->spacing[u] * 0.5f - cu;
+					float fv = (p[v] - vol->origin[v]) / vol->spacing[v] * 0.5f - cv;
+					float dist[4] = { fabsf(fv), fabsf(fu - 1), fabsf(fv - 1), fabsf(fu) };
+					int best = 0;
+					for (int i=1;i<4;i++)
+						if (dist[i] < dist[best])
+							best = i;
+					ends[k][e] = best;
+				}
+			}
+
+			// The neighbour's surface joins the sides up in pairs.
+			// With one piece that's just its ends, otherwise get the
+			// neighbour's cell and see how its triangles do it.
+			int partner[4] = { -1, -1, -1, -1 };
+			if (counts[cell] == 1)
+			{
+				partner[ends[0][1]] = ends[0][0];
+			} else {
+				int lo[3], corners = 0;
+				lo[axis] = side ? cells : -2;
+				lo[u] = cu*2;
+				lo[v] = cv*2;
+				for (int k=0;k<8;k++)
+				{
+					int c[3];
+					for (int i=0;i<3;i++)
+						c[i] = lo[i] + mcCubeCorners[k][i]*2;
+					float value;
+					if (c[axis] == (side ? cells : 0))
+					{
+						value = values[(c[2]*n + c[1])*n + c[0]];
+					} else {
+						float pos[3], extra[MC_EXTRA_DATA+1];
+						for (int i=0;i<3;i++)
+							pos[i] = vol->origin[i] + vol->spacing[i]*c[i];
+						value = mcCallFieldC(field, pos, extra);
+					}
+					corners |= mcSignBit(value) << k;
+				}
+
+				// Triangle edges on the face that only one triangle
+				// has are where the surface crosses it.
+				int inPlane = side ? 0 : 1, used[4][4] = { { 0 } }, sideOf[12];
+				for (int e=0;e<12;e++)
+				{
+					const int *c0 = mcCubeCorners[mcCubeEdges[e][0]], *c1 = mcCubeCorners[mcCubeEdges[e][1]];
+					sideOf[e] = -1;
+					if (c0[axis] != inPlane || c1[axis] != inPlane)
+						continue;
+					if (c0[u] != c1[u])
+						sideOf[e] = c0[v] ? 2 : 0;
+					else
+						sideOf[e] = c0[u] ? 1 : 3;
+				}
+				const char *tcode = mcTriTable[corners];
+				for (int i=0;tcode[i]>=0;i+=3)
+				{
+					for (int e=0;e<3;e++)
+					{
+						int a = sideOf[(int)tcode[i+e]], b = sideOf[(int)tcode[i+(e+1)%3]];
+						if (a >= 0 && b >= 0)
+						{
+							used[a][b]++;
+							used[b][a]++;
+						}
+					}
+				}
+				for (int a=0;a<4;a++)
+					for (int b=0;b<4;b++)
+						if (a != b && used[a][b] == 1)
+							partner[a] = b;
+			}
+
+			// Walk round each loop of pieces and joins, and fan
+			// triangles across it, facing the other way to ours.
+			int done = 0;
+			for (int k=0;k<counts[cell];k++)
+			{
+				if (done & (1 << k))
+					continue;
+				int loop[24], nloop = 0, piece = k;
+				while (!(done & (1 << piece)))
+				{
+					const int *p = &path[pieces[cell*2 + piece]];
+					done |= 1 << piece;
+					for (int i=0;i<p[0];i++)
+						loop[nloop++] = p[1+i];
+
+					// Find the piece that starts where this one's join goes.
+					int to = partner[ends[piece][1]];
+					piece = -1;
+					for (int m=0;m<counts[cell];m++)
+						if (ends[m][0] == to)
+							piece = m;
+					if (piece < 0)
+						break;
+				}
+				if (piece != k)
+					continue;
+
+				if (ntris + nloop > maxtris)
+				{
+					maxtris = (ntris + nloop) * 2;
+					tris = (int *)MC_REALLOC(tris, sizeof(int) * 3 * maxtris);
+					if (!tris)
+					{
+						failed = 1;
+						goto end;
+					}
+				}
+				for (int i=1;i<nloop-1;i++)
+				{
+					if (loop[i] == loop[i+1] || loop[0] == loop[i] || loop[0] == loop[i+1])
+						continue;
+					tris[ntris*3+0] = loop[0];
+					tris[ntris*3+1] = loop[i+1];
+					tris[ntris*3+2] = loop[i];
+					ntris++;
+				}
+			}
+		}
+	}
+
+	// Add them to the mesh.
+	if (ntris)
+	{
+		int *indices = (int *)MC_REALLOC(mesh->indices, sizeof(int) * 3 * (mesh->ntris + ntris));
+		if (!indices)
+		{
+			failed = 1;
+			goto end;
+		}
+		mesh->indices = indices;
+		for (int i=0;i<ntris*3;i++)
+			indices[mesh->ntris*3 + i] = tris[i];
+		mesh->ntris += ntris;
+	}
+
+end:
+	mcFreePtr(next);
+	mcFreePtr(pieces);
+	mcFreePtr(counts);
+	mcFreePtr(path);
+	mcFreePtr(tris);
+	return failed;
+}
+
+McMesh mcGenerateChunk(const float *origin, float cellsize, int cells, const McChunk *chunk, const McConfig *config)
+{
+	McMesh mesh = { 0, 0, NULL, NULL };
+	McFieldC field = { config->fn, config->batchFn, config->gradFn, config->boundFn, config->lipschitz, config->userparam, NULL };
+	int n = cells+1;
+	float spacing = cellsize * (float)(1 << chunk->lod);
+	int gridNormals = config->normals == MC_NORMALS_GRID && !field.gradFn;
+
+	McVolume vol;
+	vol.type = MC_VOLUME_FLOAT;
+	vol.iso = 0;
+	for (int i=0;i<3;i++)
+	{
+		vol.size[i] = n;
+		vol.origin[i] = origin[i] + spacing * cells * chunk->coord[i];
+		vol.spacing[i] = spacing;
+	}
+	vol.stride[0] = 1;
+	vol.stride[1] = n;
+	vol.stride[2] = n*n;
+
+	// Nothing to do for chunks the bounds say are empty,
+	// unless the neighbours are waiting on our faces.
+	int saving = 0;
+	for (int f=0;f<6;f++)
+		saving |= chunk->borderOut[f] != NULL;
+	if (!saving && mcHasBound(&field))
+	{
+		float bmax[3], lo, hi;
+		for (int i=0;i<3;i++)
+			bmax[i] = vol.origin[i] + spacing * cells;
+		mcCallBound(&field, vol.origin, bmax, &lo, &hi);
+		if (lo > 0 || hi < 0)
+			return mesh;
+	}
+
+	float *values = (float *)MC_REALLOC(NULL, sizeof(float) * n*n*n);
+	unsigned char *known = (unsigned char *)MC_REALLOC(NULL, n*n*n);
+	float *batch = (float *)MC_REALLOC(NULL, sizeof(float) * n * (4 + MC_EXTRA_DATA));
+	if (!values || !known || !batch)
+		goto end;
+	for (int i=0;i<n*n*n;i++)
+		known[i] = 0;
+
+	// Take what we're given on the faces, and don't sample the points
+	// that get made to match a coarser neighbour.
+	for (int f=0;f<6;f++)
+	{
+		int axis = f >> 1, plane = (f & 1) ? cells : 0;
+		for (int j=0;j<n;j++)
+		{
+			for (int i=0;i<n;i++)
+			{
+				int idx = mcChunkIndex(n, axis, plane, i, j);
+				if (chunk->border[f])
+				{
+					values[idx] = chunk->border[f][j*n + i];
+					known[idx] = 1;
+				}
+				if ((chunk->coarser & (1 << f)) && ((i | j) & 1))
+					known[idx] = 1;
+			}
+		}
+	}
+
+	// Sample the rest a row at a time.
+	for (int z=0;z<n;z++)
+	{
+		for (int y=0;y<n;y++)
+		{
+			int row = (z*n + y)*n;
+			float pos[3] = { vol.origin[0], vol.origin[1] + spacing*y, vol.origin[2] + spacing*z };
+			mcSampleRow(&field, pos, spacing, 0, n, known + row, values + row, batch);
+		}
+	}
+
+	// Make the faces next to coarser chunks linear between every other
+	// sample, like the neighbour's cells.
+	for (int f=0;f<6;f++)
+	{
+		if (!(chunk->coarser & (1 << f)))
+			continue;
+		int axis = f >> 1, plane = (f & 1) ? cells : 0;
+		for (int j=0;j<n;j++)
+		{
+			for (int i=0;i<n;i++)
+			{
+				if (!((i | j) & 1))
+					continue;
+				int i0 = i & ~1, j0 = j & ~1;
+				int i1 = (i & 1) && i0+2 <= cells ? i0+2 : i0;
+				int j1 = (j & 1) && j0+2 <= cells ? j0+2 : j0;
+				values[mcChunkIndex(n, axis, plane, i, j)] = 0.25f * (
+					values[mcChunkIndex(n, axis, plane, i0, j0)] + values[mcChunkIndex(n, axis, plane, i1, j0)] +
+					values[mcChunkIndex(n, axis, plane, i0, j1)] + values[mcChunkIndex(n, axis, plane, i1, j1)]);
+			}
+		}
+	}
+
+	for (int f=0;f<6;f++)
+	{
+		if (!chunk->borderOut[f])
+			continue;
+		int axis = f >> 1, plane = (f & 1) ? cells : 0;
+		for (int j=0;j<n;j++)
+			for (int i=0;i<n;i++)
+				chunk->borderOut[f][j*n + i] = values[mcChunkIndex(n, axis, plane, i, j)];
+	}
+
+	// Grid normals only come from the grid inside the chunk. That's
+	// one-sided on the faces, and wouldn't match the neighbour's, so
+	// vertices on the faces sample the field instead.
+	vol.data = values;
+	mesh = mcGenerateVolume(&vol, config->threads, 0, gridNormals ? MC_NORMALS_GRID : MC_NORMALS_FIELD);
+	for (int f=0;f<6 && mesh.verts;f++)
+	{
+		if ((chunk->coarser & (1 << f)) && mcStitchChunkFace(&mesh, &vol, values, f, &field))
+			mcFree(&mesh);
+	}
+	if (gridNormals)
+	{
+		for (int i=0;i<mesh.nverts;i++)
+		{
+			const float *p = &mesh.verts[i].x;
+			for (int axis=0;axis<3;axis++)
+			{
+				if (p[axis] == vol.origin[axis] || p[axis] == vol.origin[axis] + vol.spacing[axis] * cells)
+				{
+					McMesh one = { 1, 0, &mesh.verts[i], NULL };
+					mcFieldVertices(&one, &field, spacing * 0.1f, 1);
+					break;
+				}
+			}
+		}
+	}
+	if (!gridNormals || MC_EXTRA_DATA > 0)
+		mcFieldVertices(&mesh, &field, spacing * 0.1f, !gridNormals);
+
+end:
+	mcFreePtr(values);
+	mcFreePtr(known);
+	mcFreePtr(batch);
+	return mesh;
+}
+
+//--- Contexts ------------------------------------------------------------
+
+struct McContext {
+	McFieldC field;
+	int normals;
+	McVolume vol;			// all the samples
+	float *values;
+	int blocks[3];
+	McMesh *meshes;			// one per block
+	int *changed;			// blocks remade by the last update
+	unsigned char *dirty;
+	float *batch;			// for mcSampleRow, and one more row
+};
+
+// Makes the mesh for one block of a context from its samples.
+static void mcContextRemesh(McContext *ctx, int block)
+{
+	int b[3] = { block % ctx->blocks[0], (block / ctx->blocks[0]) % ctx->blocks[1], block / (ctx->blocks[0]*ctx->blocks[1]) };
+	McVolume sub = ctx->vol;
+	ptrdiff_t offset = 0;
+	for (int i=0;i<3;i++)
+	{
+		int x0 = b[i] * MC_CONTEXT_BLOCK;
+		int cells = ctx->vol.size[i]-1 - x0;
+		sub.size[i] = (cells < MC_CONTEXT_BLOCK ? cells : MC_CONTEXT_BLOCK) + 1;
+		sub.origin[i] = ctx->vol.origin[i] + ctx->vol.spacing[i]*x0;
+		offset += (ptrdiff_t)x0 * ctx->vol.stride[i];
+	}
+	sub.data = ctx->values + offset;
+
+	McMesh *mesh = &ctx->meshes[block];
+	mcFree(mesh);
+	*mesh = mcGenerateVolume(&sub, 1, 0, MC_NORMALS_FIELD);
+
+	// The block only sees its own samples, so get grid normals
+	// from all of them, to match where blocks meet.
+	const McFieldC *field = &ctx->field;
+	if (ctx->normals == MC_NORMALS_GRID && !field->gradFn)
+	{
+		McHelper help;
+		help.mesh = *mesh;
+		mcCalcVolumeNormals(&help, &ctx->vol, 0);
+	}
+	if (ctx->normals != MC_NORMALS_GRID || field->gradFn || MC_EXTRA_DATA > 0)
+		mcFieldVertices(mesh, field, ctx->vol.spacing[0] * 0.1f, ctx->normals != MC_NORMALS_GRID);
+}
+
+McContext *mcCreateContext(const float *bmin, const float *bmax, float cellsize, const McConfig *config)
+{
+	McGrid grid;
+	mcGridFromBounds(&grid, bmin, bmax, cellsize);
+
+	McContext *ctx = (McContext *)MC_REALLOC(NULL, sizeof(McContext));
+	if (!ctx)
+		return NULL;
+	McFieldC field = { config->fn, config->batchFn, config->gradFn, NULL, 0, config->userparam, NULL };
+	ctx->field = field;
+	ctx->normals = config->normals;
+	ctx->vol.type = MC_VOLUME_FLOAT;
+	ctx->vol.iso = 0;
+	ctx->vol.size[0] = grid.xd+1;
+	ctx->vol.size[1] = grid.yd+1;
+	ctx->vol.size[2] = grid.zd+1;
+	ctx->vol.stride[0] = 1;
+	ctx->vol.stride[1] = ctx->vol.size[0];
+	ctx->vol.stride[2] = ctx->vol.size[0] * ctx->vol.size[1];
+	int nblocks = 1;
+	for (int i=0;i<3;i++)
+	{
+		ctx->vol.origin[i] = grid.bmin[i];
+		ctx->vol.spacing[i] = grid.cellsize[i];
+		ctx->blocks[i] = (ctx->vol.size[i]-1 + MC_CONTEXT_BLOCK-1) / MC_CONTEXT_BLOCK;
+		if (ctx->blocks[i] < 1)
+			ctx->blocks[i] = 1;
+		nblocks *= ctx->blocks[i];
+	}
+
+	size_t count = (size_t)ctx->vol.stride[2] * ctx->vol.size[2];
+	ctx->values = (float *)MC_REALLOC(NULL, sizeof(float) * count);
+	ctx->meshes = (McMesh *)MC_REALLOC(NULL, sizeof(McMesh) * nblocks);
+	ctx->changed = (int *)MC_REALLOC(NULL, sizeof(int) * nblocks);
+	ctx->dirty = (unsigned char *)MC_REALLOC(NULL, nblocks);
+	ctx->batch = (float *)MC_REALLOC(NULL, sizeof(float) * ctx->vol.size[0] * (5 + MC_EXTRA_DATA));
+	ctx->vol.data = ctx->values;
+	if (ctx->meshes)
+	{
+		McMesh empty = { 0, 0, NULL, NULL };
+		for (int b=0;b<nblocks;b++)
+			ctx->meshes[b] = empty;
+	}
+	if (!ctx->values || !ctx->meshes || !ctx->changed || !ctx->dirty || !ctx->batch)
+	{
+		mcFreeContext(ctx);
+		return NULL;
+	}
+
+	for (int z=0;z<ctx->vol.size[2];z++)
+	{
+		for (int y=0;y<ctx->vol.size[1];y++)
+		{
+			float pos[3] = { grid.bmin[0], grid.bmin[1] + grid.cellsize[1]*y, grid.bmin[2] + grid.cellsize[2]*z };
+			float *row = ctx->values + (size_t)z*ctx->vol.stride[2] + (size_t)y*ctx->vol.stride[1];
+			mcSampleRow(&field, pos, grid.cellsize[0], 0, ctx->vol.size[0], NULL, row, ctx->batch);
+		}
+	}
+	for (int b=0;b<nblocks;b++)
+		mcContextRemesh(ctx, b);
+	return ctx;
+}
+
+int mcUpdateContext(McContext *ctx, const float *bmin, const float *bmax, const int **changed)
+{
+	int lo[3], hi[3], nblocks = ctx->blocks[0] * ctx->blocks[1] * ctx->blocks[2];
+	const McVolume *vol = &ctx->vol;
+	if (changed)
+		*changed = ctx->changed;
+	for (int i=0;i<3;i++)
+	{
+		lo[i] = (int)ceilf((bmin[i] - vol->origin[i]) / vol->spacing[i]);
+		hi[i] = (int)floorf((bmax[i] - vol->origin[i]) / vol->spacing[i]);
+		lo[i] = lo[i] < 0 ? 0 : lo[i];
+		hi[i] = hi[i] >= vol->size[i] ? vol->size[i]-1 : hi[i];
+		if (lo[i] > hi[i])
+			return 0;
+	}
+	for (int b=0;b<nblocks;b++)
+		ctx->dirty[b] = 0;
+
+	// A corner is in the cells either side of it, and grid normals
+	// reach one cell further.
+	int reach = ctx->normals == MC_NORMALS_GRID && !ctx->field.gradFn ? 2 : 1;
+	int count = hi[0] - lo[0] + 1;
+	float *fresh = ctx->batch + count*(4 + MC_EXTRA_DATA);
+	for (int z=lo[2];z<=hi[2];z++)
+	{
+		for (int y=lo[1];y<=hi[1];y++)
+		{
+			float pos[3] = { vol->origin[0], vol->origin[1] + vol->spacing[1]*y, vol->origin[2] + vol->spacing[2]*z };
+			float *row = ctx->values + (size_t)z*vol->stride[2] + (size_t)y*vol->stride[1] + lo[0];
+			mcSampleRow(&ctx->field, pos, vol->spacing[0], lo[0], count, NULL, fresh, ctx->batch);
+			for (int x=0;x<count;x++)
+			{
+				if (row[x] == fresh[x])
+					continue;
+				row[x] = fresh[x];
+
+				// Mark every block with a cell that can see it.
+				int p[3] = { lo[0]+x, y, z }, b0[3], b1[3];
+				for (int i=0;i<3;i++)
+				{
+					int c0 = p[i] - reach, c1 = p[i] + reach - 1;
+					c0 = c0 < 0 ? 0 : c0;
+					c1 = c1 > vol->size[i]-2 ? vol->size[i]-2 : c1;
+					b0[i] = c0 / MC_CONTEXT_BLOCK;
+					b1[i] = c1 < 0 ? 0 : c1 / MC_CONTEXT_BLOCK;
+				}
+				for (int bz=b0[2];bz<=b1[2];bz++)
+					for (int by=b0[1];by<=b1[1];by++)
+						for (int bx=b0[0];bx<=b1[0];bx++)
+							ctx->dirty[(bz*ctx->blocks[1] + by)*ctx->blocks[0] + bx] = 1;
+			}
+		}
+	}
+
+	int nchanged = 0;
+	for (int b=0;b<nblocks;b++)
+	{
+		if (!ctx->dirty[b])
+			continue;
+		mcContextRemesh(ctx, b);
+		ctx->changed[nchanged++] = b;
+	}
+	return nchanged;
+}
+
+int mcContextBlocks(const McContext *ctx)
+{
+	return ctx->blocks[0] * ctx->blocks[1] * ctx->blocks[2];
+}
+
+const McMesh *mcContextBlock(const McContext *ctx, int block)
+{
+	return &ctx->meshes[block];
+}
+
+McMesh mcContextMesh(const McContext *ctx)
+{
+	McMesh mesh = { 0, 0, NULL, NULL };
+	int nblocks = mcContextBlocks(ctx);
+	for (int b=0;b<nblocks;b++)
+	{
+		mesh.nverts += ctx->meshes[b].nverts;
+		mesh.ntris += ctx->meshes[b].ntris;
+	}
+	mesh.verts = (McVertex *)MC_REALLOC(NULL, sizeof(McVertex) * (mesh.nverts + 1));
+	mesh.indices = (int *)MC_REALLOC(NULL, sizeof(int) * 3 * (mesh.ntris + 1));
+	if (!mesh.verts || !mesh.indices)
+	{
+		mcFree(&mesh);
+		return mesh;
+	}
+
+	int nverts = 0, nindices = 0;
+	for (int b=0;b<nblocks;b++)
+	{
+		const McMesh *part = &ctx->meshes[b];
+		for (int i=0;i<part->nverts;i++)
+			mesh.verts[nverts + i] = part->verts[i];
+		for (int i=0;i<part->ntris*3;i++)
+			mesh.indices[nindices + i] = part->indices[i] + nverts;
+		nverts += part->nverts;
+		nindices += part->ntris*3;
+	}
+	return mesh;
+}
+
+void mcFreeContext(McContext *ctx)
+{
+	if (ctx->meshes)
+	{
+		for (int b=0;b<mcContextBlocks(ctx);b++)
+			mcFree(&ctx->meshes[b]);
+	}
+	mcFreePtr(ctx->values);
+	mcFreePtr(ctx->meshes);
+	mcFreePtr(ctx->changed);
+	mcFreePtr(ctx->dirty);
+	mcFreePtr(ctx->batch);
+	mcFreePtr(ctx);
+}
+
+McMesh mcGenerateParallel(const float *bmin, const float *bmax, float cellsize, McIsoFn *fn, void *userparam, int nthreads)
+{
+	McConfig config = { fn, NULL, userparam, nthreads > 0 ? nthreads : -1, MC_NORMALS_FIELD, NULL, NULL, 0, 0 };
+	return mcGenerateEx(bmin, bmax, cellsize, &config);
+}
+
+McMesh mcGenerate(const float *bmin, const float *bmax, float cellsize, McIsoFn *fn, void *userparam)
+{
+	McConfig config = { fn, NULL, userparam, 1, MC_NORMALS_FIELD, NULL, NULL, 0, 0 };
+	return mcGenerateEx(bmin, bmax, cellsize, &config);
 }
 
 void mcFree(McMesh *mesh)
 {
-	MC_REALLOC(mesh->verts, 0);
-	MC_REALLOC(mesh->indices, 0);
+	mcFreePtr(mesh->verts);
+	mcFreePtr(mesh->indices);
+	mesh->verts = NULL;
+	mesh->indices = NULL;
 	mesh->nverts = 0;
 	mesh->ntris = 0;
 }
@@ -5,6 +5,8 @@
 // To generate the implementation, place this define in exactly one source
 // file before including the header:
 // #define RJM_RAYTRACE_IMPLEMENTATION
+// C++ files that use rjm_raytracet also need this, before including it:
+// #define RJM_RAYTRACE_TEMPLATE
 
 
 // This is free and unencumbered software released into the public domain.
@@ -36,6 +38,42 @@
 #ifndef __RJM_RAYTRACE_H__
 #define __RJM_RAYTRACE_H__
 
+#include <stddef.h>
+
+// Tweak for maximum number of tris per leaf node.
+#ifndef RJM_MAX_RAYTREE_LEAF_TRIS
+#define RJM_MAX_RAYTREE_LEAF_TRIS	4
+#endif
+
+// Custom memory allocator. The whole tree lives in a single block,
+// so these only get called once per build.
+// tag is one of the RJM_RAYALLOC_ kinds below, and user is the tree's
+// allocUser, so you can tell which arena or pool each one is for.
+#ifndef RJM_RAYTRACE_MALLOC
+#include <stdlib.h>
+#define RJM_RAYTRACE_MALLOC(size, tag, user)	malloc(size)
+#define RJM_RAYTRACE_FREE(ptr, tag, user)		free(ptr)
+#endif
+
+// Kinds of memory passed to RJM_RAYTRACE_MALLOC.
+#define RJM_RAYALLOC_TREE		0	// a tree's block, kept while it's in use
+#define RJM_RAYALLOC_SCRATCH	1	// working memory for tracing (rjm_sortrayhits, RjmRayProgress)
+
+// Tweak for the alignment of the tree data. (nodes start on a cache line)
+#ifndef RJM_RAYTREE_ALIGN
+#define RJM_RAYTREE_ALIGN			64
+#endif
+
+// Tweak for the relative cost of a box test vs a triangle test, for rjm_raytreeinfo.
+#ifndef RJM_SAH_NODE_COST
+#define RJM_SAH_NODE_COST			1.0f
+#endif
+
+// Tweak for maximum rays to trace at once (limited by stack space, must be multiple of 4)
+#ifndef RJM_PACKET_SIZE
+#define RJM_PACKET_SIZE				64
+#endif
+
 // User-callback for querying opacity for a triangle (e.g. via a texture map),
 // or for just ignoring specific triangles entirely.
 // Given U/V barycentric co-ordinates on a triangle, should return the
@@ -50,9 +88,11 @@ typedef struct RjmRayTree
 	int triCount;
 	float *vtxs;	// one vec3 per vertex
 	int *tris;		// three vertex indices per triangle
+	void *allocUser;	// passed to RJM_RAYTRACE_MALLOC/FREE (can be NULL)
 
 	// These are built by the library:
-	int firstLeaf;
+	void *mem;		// block holding the arrays below (NULL if you supplied it)
+	int nodeCount, leafCount;
 	int *leafTris;
 	struct RjmRayNode *nodes;
 	struct RjmRayLeaf *leafs;
@@ -68,13 +108,66 @@ typedef struct RjmRay
 	float visibility;		// output: ratio of how much the ray was blocked by geometry
 } RjmRay;
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Initializes a tree from its scene description.
 // Do this before tracing any rays.
+// If the memory can't be allocated, the tree is left empty (nodes is NULL).
 void rjm_buildraytree(RjmRayTree *tree);
 
+// Returns how many bytes of memory a tree with this many triangles needs.
+size_t rjm_raytreememsize(int triCount);
+
+// Same as rjm_buildraytree, but places the tree in your own memory
+// instead of allocating it. mem must be at least rjm_raytreememsize bytes,
+// aligned to RJM_RAYTREE_ALIGN, and must stay around while the tree is in use.
+void rjm_buildraytreemem(RjmRayTree *tree, void *mem);
+
 // Frees the internal data for a tree.
+// (this does nothing to memory passed to rjm_buildraytreemem)
 void rjm_freeraytree(RjmRayTree *tree);
 
+// Makes a copy of a built tree for tracing on a specific NUMA node.
+// All of the tree's memory, including a copy of your vtxs/tris, is placed
+// on that node. Make one copy per node, and have each worker thread trace
+// against the copy for the node it runs on. Free it with rjm_freeraytree.
+// Placement is only done if you define RJM_RAYTRACE_NUMA (Linux only, link
+// with -lnuma, and define _GNU_SOURCE before your first #include, as
+// it needs sched_getcpu); otherwise, or if the system has no NUMA
+// support, this just makes a plain copy.
+// If the memory can't be allocated, dst is left empty (nodes is NULL).
+void rjm_replicateraytree(RjmRayTree *dst, const RjmRayTree *src, int numaNode);
+
+// Returns how many NUMA nodes the system has (1 if unknown).
+int rjm_raytree_numanodes(void);
+
+// Returns the NUMA node the calling thread is currently running on (0 if unknown).
+int rjm_raytree_numanode(void);
+
+// Restricts the calling thread to run only on the CPUs of the given NUMA node.
+// Returns 0 on success.
+int rjm_raytree_bindthread(int numaNode);
+
+// Size and quality information about a built tree.
+typedef struct RjmRayTreeInfo
+{
+	size_t nodeBytes;		// memory used by the nodes array
+	size_t leafBytes;		// memory used by the leafs array
+	size_t leafTriBytes;	// memory used by the leafTris array
+	size_t totalBytes;		// sum of the above (your vtxs/tris are not included)
+	int nodeCount, leafCount;
+	int depth;				// longest path from the root to a leaf
+	int leafFill[RJM_MAX_RAYTREE_LEAF_TRIS+1];	// number of leaves holding 0..N triangles
+	float sahCost;			// surface area heuristic cost, in units of one ray-triangle test
+} RjmRayTreeInfo;
+
+// Fills in the info for a tree (call rjm_buildraytree on it first).
+// The SAH cost is the expected work for a random ray that hits the root
+// bounds, counting a box test as RJM_SAH_NODE_COST triangle tests.
+void rjm_raytreeinfo(const RjmRayTree *tree, RjmRayTreeInfo *info);
+
 #define RJM_RAYTRACE_FIRSTHIT	-1
 
 // Traces a batch of rays against the tree.
@@ -89,34 +182,554 @@ void rjm_freeraytree(RjmRayTree *tree);
 //    stop once the visibility falls below or equal to this value.
 void rjm_raytrace(RjmRayTree *tree, int nrays, RjmRay *rays, float cutoff, RjmRayFilterFn *filter, void *userdata);
 
+// Orders traced rays by what they hit, so a shading pass can walk through
+// them with coherent access to triangle/material/texture data.
+// keys:   per-triangle sort key in 0..nkeys-1 (e.g. a material ID),
+//         or NULL to just sort by the triangle hit.
+// order:  receives nrays ray indices. Rays hitting the same key are
+//         contiguous (in their original order), and rays that hit nothing
+//         come last.
+// scratch: nkeys+1 ints (triCount+1 if keys is NULL) for the sort to use,
+//         e.g. kept around between frames, or NULL to allocate it each call.
+// Returns the number of rays that hit something, or -1 if the scratch
+// memory couldn't be allocated (order is left alone).
+int rjm_sortrayhits(const RjmRayTree *tree, int nrays, const RjmRay *rays, const int *keys, int nkeys, int *order, int *scratch);
+
+// Tweak for how many rays rjm_traceprogress generates and traces at once.
+#ifndef RJM_RAYPROGRESS_BATCH
+#define RJM_RAYPROGRESS_BATCH		(RJM_PACKET_SIZE*16)
+#endif
 
-//--- Implementation follows ----------------------------------------------
+// User-callback for generating rays for rjm_traceprogress.
+// Should fill in org/dir/t for rays[0..count-1], which are sample number
+// 'sample' for groups firstGroup..firstGroup+count-1.
+typedef void RjmRayGenFn(int firstGroup, int count, int sample, RjmRay *rays, void *userdata);
 
-#ifdef RJM_RAYTRACE_IMPLEMENTATION
+// Progressive trace, for refining a result (e.g. a lightmap preview) a
+// little at a time. Each group (e.g. a texel) gets the average visibility
+// of its samples. Samples are traced one pass at a time over all groups,
+// so the result is usable after every call, just noisier.
+typedef struct RjmRayProgress
+{
+	// Fill these in yourself:
+	RjmRayTree *tree;
+	int groupCount;			// number of groups to trace
+	int sampleCount;		// samples wanted per group (0 to keep going forever)
+	float cutoff;			// passed to rjm_raytrace
+	RjmRayGenFn *gen;		// generates the rays for each sample
+	RjmRayFilterFn *filter;	// passed to rjm_raytrace (can be NULL)
+	void *userdata;			// passed to gen and filter
+
+	// These are managed by the library:
+	float *sum;				// total visibility so far, per group
+	RjmRay *rays;			// batch being traced
+	int pass;				// sample being traced
+	int next;				// next group to trace in this pass
+	double rayTime;			// measured seconds per ray (0 until known)
+	void *allocUser;		// tree->allocUser, when the memory was allocated
+} RjmRayProgress;
+
+// Sets up a progressive trace (fill in your fields first).
+// Returns 0 if the memory couldn't be allocated, in which case sum is NULL
+// and rjm_traceprogress does nothing, or 1 if it's ready to go.
+int rjm_initrayprogress(RjmRayProgress *prog);
+
+// Throws away the samples so far and starts again from the first pass,
+// e.g. after the scene changes.
+void rjm_resetrayprogress(RjmRayProgress *prog);
+
+// Frees the internal data for a progressive trace.
+void rjm_freerayprogress(RjmRayProgress *prog);
+
+// Traces more of a progressive trace, stopping once it has used up
+// 'seconds' of time or traced 'maxRays' rays (either can be 0 for no limit).
+// Batches are sized to fit in what's left of the time, based on the speed
+// measured by earlier batches, so this should rarely overrun by much.
+// At least one packet is always traced (unless finished).
+// With no limits, it runs until all samples are done, or if sampleCount
+// is 0, until the end of the current pass.
+// Returns the number of rays traced, or 0 once all samples are done.
+int rjm_traceprogress(RjmRayProgress *prog, double seconds, int maxRays);
+
+// Returns how many samples a group has had so far.
+int rjm_rayprogress_samples(const RjmRayProgress *prog, int group);
+
+// Returns the current visibility (0-1) for a group, or 1 if it has no samples yet.
+float rjm_rayprogress_result(const RjmRayProgress *prog, int group);
+
+#ifdef RJM_RAYTRACE_STATS
+// Traversal counters, only recorded if RJM_RAYTRACE_STATS is defined
+// (otherwise they compile away entirely).
+// Leaf fill is leafTris / (leafs * RJM_MAX_RAYTREE_LEAF_TRIS).
+// Packet occupancy is rays / (packets * RJM_PACKET_SIZE).
+typedef struct RjmRayStats
+{
+	long long rays;			// rays traced
+	long long packets;		// packets traced
+	long long nodes;		// interior nodes visited by a packet
+	long long leafs;		// leaf nodes whose bounds were hit by a packet
+	long long leafTris;		// triangles stored in the visited leaves
+	long long slabTests;	// individual ray-box tests
+	long long triTests;		// individual ray-triangle tests
+	long long filterCalls;	// calls made to the filter callback
+	long long active[RJM_PACKET_SIZE/4+1];	// node visits, by number of active rays/4
+} RjmRayStats;
+
+// Fetches the counters recorded by the last call to rjm_raytrace
+// made on the calling thread.
+void rjm_raytracestats(RjmRayStats *stats);
+#endif
 
-// Tweak for maximum number of tris per leaf node.
-#define RJM_MAX_RAYTREE_LEAF_TRIS	4
+#ifdef __cplusplus
+}
+#endif
 
-// Tweak for maximum rays to trace at once (limited by stack space, must be multiple of 4)
-#define RJM_PACKET_SIZE				64
+// Trace modes, for the C++ interface below.
+#define RJM_RAYMODE_FIRSTHIT	0	// find the earliest intersection (cutoff is ignored)
+#define RJM_RAYMODE_VISIBILITY	1	// accumulate visibility, stopping at the cutoff
+#define RJM_RAYMODE_OCCLUSION	2	// accumulate visibility, stopping once fully blocked
+
+#if defined(__cplusplus) && (defined(RJM_RAYTRACE_TEMPLATE) || defined(RJM_RAYTRACE_IMPLEMENTATION))
+// Filter that accepts every intersection.
+struct RjmNoFilter
+{
+	float operator()(int, int, float, float, float) const { return 1.0f; }
+};
+
+// C++ version of rjm_raytrace, with the trace mode, packet size and filter
+// fixed at compile time. This lets the compiler inline the filter and drop
+// the per-hit checks that the C version has to make.
+// Mode:       one of the RJM_RAYMODE_ values above.
+// PacketSize: max rays traced together (multiple of 4). Note the SIMD width
+//             itself is always 4, as this is an SSE tracer.
+// Filter:     any functor callable as
+//                 float filter(int triIdx, int rayIdx, float t, float u, float v)
+//             which behaves like RjmRayFilterFn.
+// rjm_raytrace is itself just one instantiation of this.
+// It's compiled into each file that uses it, so define RJM_RAYTRACE_TEMPLATE
+// before including the header there.
+template<int Mode, int PacketSize, class Filter>
+void rjm_raytracet(RjmRayTree *tree, int nrays, RjmRay *rays, float cutoff, Filter filter);
+#endif
+
+
+//--- Implementation follows ----------------------------------------------
+
+// The traversal is also needed by the C++ template, which gets
+// instantiated in whichever file uses it.
+#if defined(RJM_RAYTRACE_IMPLEMENTATION) || (defined(__cplusplus) && defined(RJM_RAYTRACE_TEMPLATE))
 
-#include <stddef.h>
 #include <stdint.h>
 #include <xmmintrin.h>
 #include <assert.h>
 #include <float.h>
+#include <string.h>
 
 #define RJM_RT_SWAP(T, X, Y) { T _tmp = (X); (X) = (Y); (Y) = _tmp; }
 
 #ifdef _MSC_VER
 #define RJM_RT_ALIGN	__declspec(align(16))
+#define RJM_RT_THREAD	__declspec(thread)
+#define RJM_RT_INLINE	__forceinline
 #else
 #define RJM_RT_ALIGN	__attribute__((aligned(16)))
+#define RJM_RT_THREAD	__thread
+#define RJM_RT_INLINE	inline __attribute__((always_inline))
 #endif
 
-typedef struct RjmRayNode { float bmin[3], bmax[3]; } RjmRayNode;
+#ifdef RJM_RAYTRACE_STATS
+#define RJM_RT_STAT(X)	X
+
+// Records the counters at the end of a trace. This isn't static, as
+// traces made through the C++ template call it from other files.
+#ifdef __cplusplus
+extern "C"
+#endif
+void rjm_raytrace_storestats(const RjmRayStats *stats);
+#else
+#define RJM_RT_STAT(X)
+#endif
+
+// Interior nodes point at a pair of child nodes, stored side by side
+// so that both share a cache line. Leaf nodes point at a leaf instead,
+// stored as the one's-complement of the leaf index.
+typedef struct RjmRayNode { float bmin[3], bmax[3]; int child, pad; } RjmRayNode;
 typedef struct RjmRayLeaf { int triIndex, triCount; } RjmRayLeaf;
 
+#define RJM_RT_ISLEAF(REF)	((REF) < 0)
+#define RJM_RT_LEAF(REF)	(~(REF))
+
+// Wraps the C filter callback.
+typedef struct RjmRayFilterC
+{
+	RjmRayFilterFn *fn;
+	void *userdata;
+#ifdef __cplusplus
+	float operator()(int triIdx, int rayIdx, float t, float u, float v) const { return fn(triIdx, rayIdx, t, u, v, userdata); }
+#endif
+} RjmRayFilterC;
+
+#ifdef __cplusplus
+// In C++ the traversal is a template, specialized on the mode/packet/filter.
+// (its helpers are inline rather than static, as it has external linkage)
+inline bool rjm_rt_hasfilter(const RjmNoFilter &) { return false; }
+template<class Filter> inline bool rjm_rt_hasfilter(const Filter &) { return true; }
+#define RJM_RT_HASFILTER(F)						rjm_rt_hasfilter(F)
+#define RJM_RT_CALLFILTER(F, TRI, RAY, T, U, V)	(F)(TRI, RAY, T, U, V)
+#define RJM_RT_MODE								Mode
+#define RJM_RT_PACKET							PacketSize
+
+template<int Mode, int PacketSize, class Filter>
+void rjm_raytracet(RjmRayTree *tree, int nrays, RjmRay *rays, float cutoff, Filter filter)
+#else
+// In C we get much the same effect by force-inlining it into
+// calls with constant arguments.
+#define RJM_RT_HASFILTER(F)						((F).fn != NULL)
+#define RJM_RT_CALLFILTER(F, TRI, RAY, T, U, V)	(F).fn(TRI, RAY, T, U, V, (F).userdata)
+#define RJM_RT_MODE								mode
+#define RJM_RT_PACKET							RJM_PACKET_SIZE
+
+static RJM_RT_INLINE void rjm_raytrace_core(RjmRayTree *tree, int nrays, RjmRay *rays, float cutoff, RjmRayFilterC filter, int mode)
+#endif
+{
+	// Allocate local SSE structures.
+	RJM_RT_ALIGN float rx[RJM_RT_PACKET], ry[RJM_RT_PACKET], rz[RJM_RT_PACKET];
+	RJM_RT_ALIGN float dx[RJM_RT_PACKET], dy[RJM_RT_PACKET], dz[RJM_RT_PACKET];
+	RJM_RT_ALIGN float ix[RJM_RT_PACKET], iy[RJM_RT_PACKET], iz[RJM_RT_PACKET];
+	RJM_RT_ALIGN float maxt[RJM_RT_PACKET];
+	RJM_RT_ALIGN int rayidx[RJM_RT_PACKET];
+
+	RJM_RT_ALIGN int32_t out_mask[RJM_RT_PACKET];
+	RJM_RT_ALIGN float out_u[RJM_RT_PACKET], out_v[RJM_RT_PACKET], out_t[RJM_RT_PACKET];
+
+	int stack[64], *top;
+
+#ifdef RJM_RAYTRACE_STATS
+	RjmRayStats stats;
+	memset(&stats, 0, sizeof(stats));
+#endif
+
+	// Process it in packets, in case they pass in a lot of rays at once.
+	for (int base=0;base<nrays;)
+	{
+		int npacket = nrays - base;
+		if (npacket > RJM_RT_PACKET)
+			npacket = RJM_RT_PACKET;
+		int next = base + npacket;
+		RjmRay *raybatch = rays + base;
+		RJM_RT_STAT(stats.rays += npacket);
+		RJM_RT_STAT(stats.packets++);
+
+		// Copy rays into our local structure.
+		for (int n=0;n<npacket;n++)
+		{
+			rx[n] = raybatch[n].org[0];
+			ry[n] = raybatch[n].org[1];
+			rz[n] = raybatch[n].org[2];
+			dx[n] = raybatch[n].dir[0];
+			dy[n] = raybatch[n].dir[1];
+			dz[n] = raybatch[n].dir[2];
+			ix[n] = 1.0f / raybatch[n].dir[0]; // relies on IEEE infinity
+			iy[n] = 1.0f / raybatch[n].dir[1];
+			iz[n] = 1.0f / raybatch[n].dir[2];
+			maxt[n] = raybatch[n].t;
+
+			raybatch[n].visibility = 1.0f;
+			raybatch[n].hit = -1;
+			raybatch[n].u = 0;
+			raybatch[n].v = 0;
+			rayidx[n] = base + n;
+		}
+
+		// Align up to multiple of 4.
+		while (npacket & 3) {
+			int d = npacket, s = npacket-1;
+			rx[d] = rx[s]; ry[d] = ry[s]; rz[d] = rz[s];
+			dx[d] = dx[s]; dy[d] = dy[s]; dz[d] = dz[s];
+			ix[d] = ix[s]; iy[d] = iy[s]; iz[d] = iz[s];
+			maxt[d] = maxt[s];
+			rayidx[d] = -1;
+			npacket++;
+		}
+
+		// Push terminator.
+		top = stack;
+		*top++ = 0;
+		*top++ = 0;
+
+		int nodeIdx = 0;
+		int ncur = npacket;
+
+		// Trace the tree.
+		do {
+			int nvec = ncur >> 2;
+			RJM_RT_STAT(stats.active[nvec * RJM_PACKET_SIZE / RJM_RT_PACKET]++);
+			RJM_RT_STAT(stats.slabTests += ncur);
+
+			// Start fetching whatever comes after this node (either the
+			// pair of children, which share a cache line, or the leaf)
+			// so it arrives while the box test runs.
+			RjmRayNode *node = tree->nodes + nodeIdx;
+			int child = node->child;
+			RJM_RT_STAT(stats.nodes += !RJM_RT_ISLEAF(child));
+			if (RJM_RT_ISLEAF(child))
+				_mm_prefetch((const char *)(tree->leafs + RJM_RT_LEAF(child)), _MM_HINT_T0);
+			else
+				_mm_prefetch((const char *)(tree->nodes + child), _MM_HINT_T0);
+
+			// Test bounds.
+			__m128 bminx = _mm_set_ps1(node->bmin[0]);
+			__m128 bminy = _mm_set_ps1(node->bmin[1]);
+			__m128 bminz = _mm_set_ps1(node->bmin[2]);
+			__m128 bmaxx = _mm_set_ps1(node->bmax[0]);
+			__m128 bmaxy = _mm_set_ps1(node->bmax[1]);
+			__m128 bmaxz = _mm_set_ps1(node->bmax[2]);
+
+			__m128 mask = _mm_setzero_ps();
+
+			// Ray-box slab test.
+			for (int n=0;n<nvec;n++) {
+				int p = n*4;
+				// d0 = (bmin - org) * invdir
+				// d1 = (bmax - org) * invdir
+				__m128 d0x = _mm_mul_ps(_mm_sub_ps(bminx, _mm_load_ps(rx+p)), _mm_load_ps(ix+p));
+				__m128 d0y = _mm_mul_ps(_mm_sub_ps(bminy, _mm_load_ps(ry+p)), _mm_load_ps(iy+p));
+				__m128 d0z = _mm_mul_ps(_mm_sub_ps(bminz, _mm_load_ps(rz+p)), _mm_load_ps(iz+p));
+				__m128 d1x = _mm_mul_ps(_mm_sub_ps(bmaxx, _mm_load_ps(rx+p)), _mm_load_ps(ix+p));
+				__m128 d1y = _mm_mul_ps(_mm_sub_ps(bmaxy, _mm_load_ps(ry+p)), _mm_load_ps(iy+p));
+				__m128 d1z = _mm_mul_ps(_mm_sub_ps(bmaxz, _mm_load_ps(rz+p)), _mm_load_ps(iz+p));
+
+				// v0 = min(d0, d1)
+				// v1 = max(d0, d1)
+				__m128 v0x = _mm_min_ps(d0x, d1x);
+				__m128 v0y = _mm_min_ps(d0y, d1y);
+				__m128 v0z = _mm_min_ps(d0z, d1z);
+				__m128 v1x = _mm_max_ps(d0x, d1x);
+				__m128 v1y = _mm_max_ps(d0y, d1y);
+				__m128 v1z = _mm_max_ps(d0z, d1z);
+
+				// tmin = hmax(v0)
+				// tmax = hmin(v1)
+				__m128 tmin = _mm_max_ps(v0x, _mm_max_ps(v0y, v0z));
+				__m128 tmax = _mm_min_ps(v1x, _mm_min_ps(v1y, v1z));
+
+				__m128 prevt = _mm_load_ps(maxt+p);
+
+				// hit if: (tmax >= 0) && (tmax >= tmin) && (tmin <= maxt)
+				__m128 isect = _mm_cmpge_ps(tmax, _mm_setzero_ps());
+				isect = _mm_and_ps(isect, _mm_cmpge_ps(tmax, tmin));
+				isect = _mm_and_ps(isect, _mm_cmple_ps(tmin, prevt));
+
+				mask = _mm_or_ps(mask, isect); // accumulate results
+				_mm_store_ps((float *)out_mask + p, isect);
+			}
+
+
+			// Check if any rays hit the box.
+			if (_mm_movemask_ps(mask) != 0)
+			{
+				// Re-order rays into ones that hit and ones that didn't.
+				int nhit = 0;
+				while (nhit < ncur)
+				{
+					if (out_mask[nhit] >= 0) {
+						// miss, move ray to the end
+						int d = nhit, s = --ncur;
+						RJM_RT_SWAP(float, rx[d], rx[s]);
+						RJM_RT_SWAP(float, ry[d], ry[s]);
+						RJM_RT_SWAP(float, rz[d], rz[s]);
+						RJM_RT_SWAP(float, dx[d], dx[s]);
+						RJM_RT_SWAP(float, dy[d], dy[s]);
+						RJM_RT_SWAP(float, dz[d], dz[s]);
+						RJM_RT_SWAP(float, ix[d], ix[s]);
+						RJM_RT_SWAP(float, iy[d], iy[s]);
+						RJM_RT_SWAP(float, iz[d], iz[s]);
+						RJM_RT_SWAP(float, maxt[d], maxt[s]);
+						RJM_RT_SWAP(int, rayidx[d], rayidx[s]);
+						RJM_RT_SWAP(int, out_mask[d], out_mask[s]);
+					} else {
+						// hit
+						nhit++;
+					}
+				}
+
+				if (ncur > 0) {
+					ncur = (ncur + 3) & ~3;
+					nvec = ncur >> 2;
+
+					if (!RJM_RT_ISLEAF(child)) {
+						// Recurse in with only the rays that hit the node.
+						*top++ = child+1;
+						*top++ = ncur;
+						nodeIdx = child;
+						continue;
+					}
+
+					// Leaf, test each triangle.
+					RjmRayLeaf *leaf = tree->leafs + RJM_RT_LEAF(child);
+					int *idxs = tree->leafTris + leaf->triIndex;
+					int triCount = leaf->triCount;
+					for (int n=0;n<triCount;n++)
+						_mm_prefetch((const char *)(tree->tris + idxs[n]*3), _MM_HINT_T0);
+					RJM_RT_STAT(stats.leafs++);
+					RJM_RT_STAT(stats.leafTris += triCount);
+					RJM_RT_STAT(stats.triTests += (long long)triCount * ncur);
+					while (triCount--)
+					{
+						// Read triangle data.
+						int triIdx = *idxs++;
+						int *tri = tree->tris + triIdx*3;
+						float *v0 = tree->vtxs + tri[0]*3;
+						float *v1 = tree->vtxs + tri[1]*3;
+						float *v2 = tree->vtxs + tri[2]*3;
+
+						// Fetch the next triangle while we test this one.
+						if (triCount > 0) {
+							int *nextTri = tree->tris + idxs[0]*3;
+							_mm_prefetch((const char *)(tree->vtxs + nextTri[0]*3), _MM_HINT_T0);
+							_mm_prefetch((const char *)(tree->vtxs + nextTri[1]*3), _MM_HINT_T0);
+							_mm_prefetch((const char *)(tree->vtxs + nextTri[2]*3), _MM_HINT_T0);
+						}
+
+						// Edge vector.
+						__m128 e01x = _mm_set1_ps(v1[0] - v0[0]);
+						__m128 e01y = _mm_set1_ps(v1[1] - v0[1]);
+						__m128 e01z = _mm_set1_ps(v1[2] - v0[2]);
+						__m128 e02x = _mm_set1_ps(v2[0] - v0[0]);
+						__m128 e02y = _mm_set1_ps(v2[1] - v0[1]);
+						__m128 e02z = _mm_set1_ps(v2[2] - v0[2]);
+
+						// Ray-triangle intersection.
+						__m128 hitMask = _mm_setzero_ps();
+						for (int n=0;n<nvec;n++)
+						{
+							int p = n*4;
+
+							// pvec = cross(dir, e02)
+							__m128 pvecx = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(dy+p), e02z), _mm_mul_ps(_mm_load_ps(dz+p), e02y));
+							__m128 pvecy = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(dz+p), e02x), _mm_mul_ps(_mm_load_ps(dx+p), e02z));
+							__m128 pvecz = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(dx+p), e02y), _mm_mul_ps(_mm_load_ps(dy+p), e02x));
+
+							// det = dot(e01, pvec)
+							__m128 det = _mm_add_ps(_mm_mul_ps(e01x, pvecx), _mm_add_ps(_mm_mul_ps(e01y, pvecy), _mm_mul_ps(e01z, pvecz)));
+							
+							// tvec = org - vtx0
+							__m128 tvecx = _mm_sub_ps(_mm_load_ps(rx+p), _mm_set_ps1(v0[0]));
+							__m128 tvecy = _mm_sub_ps(_mm_load_ps(ry+p), _mm_set_ps1(v0[1]));
+							__m128 tvecz = _mm_sub_ps(_mm_load_ps(rz+p), _mm_set_ps1(v0[2]));
+
+							// qvec = cross(tvec, e01)
+							__m128 qvecx = _mm_sub_ps(_mm_mul_ps(tvecy, e01z), _mm_mul_ps(tvecz, e01y));
+							__m128 qvecy = _mm_sub_ps(_mm_mul_ps(tvecz, e01x), _mm_mul_ps(tvecx, e01z));
+							__m128 qvecz = _mm_sub_ps(_mm_mul_ps(tvecx, e01y), _mm_mul_ps(tvecy, e01x));
+
+							// u = dot(tvec, pvec) * inv_det
+							// v = dot(dir, qvec) * inv_det
+							// t = dot(e02, qvec) * inv_det
+							__m128 u = _mm_add_ps(_mm_mul_ps(tvecx, pvecx), _mm_add_ps(_mm_mul_ps(tvecy, pvecy), _mm_mul_ps(tvecz, pvecz)));
+							__m128 v = _mm_add_ps(_mm_mul_ps(_mm_load_ps(dx+p), qvecx), _mm_add_ps(_mm_mul_ps(_mm_load_ps(dy+p), qvecy), _mm_mul_ps(_mm_load_ps(dz+p), qvecz)));
+							__m128 t = _mm_add_ps(_mm_mul_ps(e02x, qvecx), _mm_add_ps(_mm_mul_ps(e02y, qvecy), _mm_mul_ps(e02z, qvecz)));
+							__m128 inv_det = _mm_div_ps(_mm_set_ps1(1.0f), det);
+							u = _mm_mul_ps(u, inv_det);
+							v = _mm_mul_ps(v, inv_det);
+							t = _mm_mul_ps(t, inv_det);
+
+							// Intersection if all of:
+							// u>=0, u<=1, v>=0, u+v<=1, t>=0, t<=maxt
+							__m128 zero = _mm_setzero_ps();
+							__m128 one = _mm_set_ps1(1.0f);
+							__m128 prev = _mm_load_ps(maxt+p);
+							__m128 isect = _mm_cmpge_ps(u, zero);
+							isect = _mm_and_ps(isect, _mm_cmple_ps(u, one));
+							isect = _mm_and_ps(isect, _mm_cmpge_ps(v, zero));
+							isect = _mm_and_ps(isect, _mm_cmple_ps(_mm_add_ps(u,v), one));
+							isect = _mm_and_ps(isect, _mm_cmpge_ps(t, zero));
+							isect = _mm_and_ps(isect, _mm_cmple_ps(t, prev));
+
+							hitMask = _mm_or_ps(hitMask, isect);
+							_mm_store_ps((float *)out_mask + p, isect);
+							_mm_store_ps((float *)out_u + p, u);
+							_mm_store_ps((float *)out_v + p, v);
+							_mm_store_ps((float *)out_t + p, t);
+						}
+
+						// See which ones hit.
+						if (_mm_movemask_ps(hitMask) != 0)
+						{
+							for (int n=0;n<ncur;n++)
+							{
+								if (out_mask[n] < 0 && rayidx[n] >= 0)
+								{
+									RjmRay *ray = rays + rayidx[n];
+									if (out_t[n] < ray->t) {
+										float opacity = 1.0f;
+										if (RJM_RT_HASFILTER(filter)) {
+											RJM_RT_STAT(stats.filterCalls++);
+											opacity = RJM_RT_CALLFILTER(filter, triIdx, rayidx[n], out_t[n], out_u[n], out_v[n]);
+										}
+										if (RJM_RT_MODE != RJM_RAYMODE_FIRSTHIT)
+										{
+											// Shadow mode, accumulate total visibility.
+											ray->visibility *= (1-opacity);
+											if (ray->visibility <= (RJM_RT_MODE == RJM_RAYMODE_OCCLUSION ? 0.0f : cutoff))
+												maxt[n] = 0; // stop further testing
+										} else {
+											// Regular mode, find earliest intersection.
+											if (opacity >= 0.5f)
+											{
+												ray->t = out_t[n];
+												ray->u = out_u[n];
+												ray->v = out_v[n];
+												ray->hit = triIdx;
+												ray->visibility = 0.0f;
+												maxt[n] = out_t[n];
+											}
+										}
+									}
+								}
+							}
+						}
+					}
+				}
+			}
+
+			// Pull a new node off the stack.
+			ncur = *--top;
+			nodeIdx = *--top;
+		} while (nodeIdx);
+
+		base = next;
+	}
+
+	RJM_RT_STAT(rjm_raytrace_storestats(&stats));
+}
+
+#endif // RJM_RAYTRACE_IMPLEMENTATION || RJM_RAYTRACE_TEMPLATE
+
+#ifdef RJM_RAYTRACE_IMPLEMENTATION
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#if defined(RJM_RAYTRACE_NUMA) && defined(__linux__)
+#include <numa.h>
+#include <numaif.h>
+#include <sched.h>
+#if defined(__GLIBC__) && !defined(__USE_GNU)
+#error "RJM_RAYTRACE_NUMA needs _GNU_SOURCE defined before the first #include (for sched_getcpu)"
+#endif
+#define RJM_RT_NUMA 1
+#else
+#define RJM_RT_NUMA 0
+#endif
+
+#ifdef RJM_RAYTRACE_STATS
+static RJM_RT_THREAD RjmRayStats rjm_raytrace_laststats;
+#endif
+
 static int *rjm_raytree_partition(RjmRayTree *tree, int *left, int *right, int axis)
 {
 	int pivot = right[0];
@@ -145,19 +758,15 @@ static void rjm_raytree_quickselect(RjmRayTree *tree, int *left, int *right, int
 	}
 }
 
-static void rjm_buildraynodes(RjmRayTree *tree, int nodeIdx, int triIndex, int triCount)
+typedef struct RjmRayBuild
 {
-	if (nodeIdx >= tree->firstLeaf) {
-		assert(triCount <= RJM_MAX_RAYTREE_LEAF_TRIS);
-		RjmRayLeaf *leaf = tree->leafs + (nodeIdx - tree->firstLeaf);
-		leaf->triIndex = triIndex;
-		leaf->triCount = triCount;
-		return;
-	}
+	RjmRayTree *tree;
+	int nextNode, nextLeaf;
+} RjmRayBuild;
 
-	// Simple object-median split algorithm. Performs reasonably
-	// well, gives us a balanced, implicit tree, and is guaranteed
-	// to always split.
+static void rjm_buildraynodes(RjmRayBuild *build, int nodeIdx, int triIndex, int triCount)
+{
+	RjmRayTree *tree = build->tree;
 
 	// Calculate bounds.
 	__m128 vecmin = _mm_set_ps1(FLT_MAX);
@@ -187,332 +796,465 @@ static void rjm_buildraynodes(RjmRayTree *tree, int nodeIdx, int triIndex, int t
 	node->bmax[0] = bmax[0];
 	node->bmax[1] = bmax[1];
 	node->bmax[2] = bmax[2];
+	node->pad = 0;
+
+	if (triCount <= RJM_MAX_RAYTREE_LEAF_TRIS) {
+		int leafIdx = build->nextLeaf++;
+		RjmRayLeaf *leaf = tree->leafs + leafIdx;
+		leaf->triIndex = triIndex;
+		leaf->triCount = triCount;
+		node->child = ~leafIdx;
+		return;
+	}
+
+	// Simple object-median split algorithm. Performs reasonably
+	// well, gives us a balanced tree, and is guaranteed to always
+	// split. Child pairs are allocated depth-first.
+	int pair = build->nextNode;
+	build->nextNode += 2;
+	node->child = pair;
 
 	// Pick longest axis.
 	int axis = 0;
 	if (bdim[1] > bdim[axis]) axis = 1;
 	if (bdim[2] > bdim[axis]) axis = 2;
 
-	// Partition.
-	assert(triCount > 0);
-	int leftCount = triCount>>1;
+	// Partition. Rather than splitting exactly in half, round the left
+	// side up to a whole number of full leaves, so only the very last
+	// leaf in the tree can end up partially filled.
+	int leafCount = (triCount + RJM_MAX_RAYTREE_LEAF_TRIS-1) / RJM_MAX_RAYTREE_LEAF_TRIS;
+	int leftCount = ((leafCount+1)>>1) * RJM_MAX_RAYTREE_LEAF_TRIS;
 	int *tris = tree->leafTris + triIndex;
 	rjm_raytree_quickselect(tree, tris, tris+triCount-1, tris+leftCount, axis);
 
 	// Recurse.
-	rjm_buildraynodes(tree, nodeIdx*2+1, triIndex, leftCount);
-	rjm_buildraynodes(tree, nodeIdx*2+2, triIndex+leftCount, triCount-leftCount);
+	rjm_buildraynodes(build, pair, triIndex, leftCount);
+	rjm_buildraynodes(build, pair+1, triIndex+leftCount, triCount-leftCount);
 }
 
-void rjm_buildraytree(RjmRayTree *tree)
+static size_t rjm_raytree_roundup(size_t size)
 {
-	// Pick how many nodes we want (must be a power of 2 for balanced trees)
-	int leafCount = 1;
-	while (leafCount*RJM_MAX_RAYTREE_LEAF_TRIS < tree->triCount)
-		leafCount <<= 1;
-	
-	// Allocate memory.
-	tree->firstLeaf = leafCount - 1;
-	tree->nodes = (RjmRayNode *)malloc(tree->firstLeaf * sizeof(RjmRayNode));
-	tree->leafs = (RjmRayLeaf *)malloc(leafCount * sizeof(RjmRayLeaf));
-	tree->leafTris = (int *)malloc(tree->triCount * sizeof(int));
+	return (size + RJM_RAYTREE_ALIGN-1) & ~(size_t)(RJM_RAYTREE_ALIGN-1);
+}
+
+static int rjm_raytree_leafcount(int triCount)
+{
+	// Every leaf is full apart from the last, so we know exactly
+	// how many nodes the tree is going to need.
+	int leafCount = (triCount + RJM_MAX_RAYTREE_LEAF_TRIS-1) / RJM_MAX_RAYTREE_LEAF_TRIS;
+	return leafCount < 1 ? 1 : leafCount;
+}
+
+// The root sits on its own, followed by an unused slot so the
+// child pairs after it start on an even index (i.e. a cache line).
+static int rjm_raytree_nodeslots(int leafCount)
+{
+	return leafCount * 2;
+}
+
+size_t rjm_raytreememsize(int triCount)
+{
+	int leafCount = rjm_raytree_leafcount(triCount);
+	return rjm_raytree_roundup(rjm_raytree_nodeslots(leafCount) * sizeof(RjmRayNode))
+		 + rjm_raytree_roundup(leafCount * sizeof(RjmRayLeaf))
+		 + triCount * sizeof(int);
+}
+
+void rjm_buildraytreemem(RjmRayTree *tree, void *mem)
+{
+	assert(((uintptr_t)mem & (RJM_RAYTREE_ALIGN-1)) == 0);
+	tree->mem = NULL;
+	tree->leafCount = rjm_raytree_leafcount(tree->triCount);
+	tree->nodeCount = tree->leafCount*2 - 1;
+
+	// Place all three arrays in the one block.
+	char *ptr = (char *)mem;
+	tree->nodes = (RjmRayNode *)ptr;
+	ptr += rjm_raytree_roundup(rjm_raytree_nodeslots(tree->leafCount) * sizeof(RjmRayNode));
+	tree->leafs = (RjmRayLeaf *)ptr;
+	ptr += rjm_raytree_roundup(tree->leafCount * sizeof(RjmRayLeaf));
+	tree->leafTris = (int *)ptr;
 
 	// Fill in initial leaf data.
 	for (int n=0;n<tree->triCount;n++)
 		tree->leafTris[n] = n;
 	
 	// Recursively partition.
-	rjm_buildraynodes(tree, 0, 0, tree->triCount);
+	RjmRayBuild build;
+	build.tree = tree;
+	build.nextNode = 2;
+	build.nextLeaf = 0;
+	memset(tree->nodes + 1, 0, sizeof(RjmRayNode));
+	rjm_buildraynodes(&build, 0, 0, tree->triCount);
+	assert(build.nextNode == rjm_raytree_nodeslots(tree->leafCount));
+	assert(build.nextLeaf == tree->leafCount);
+}
+
+void rjm_buildraytree(RjmRayTree *tree)
+{
+	// Over-allocate so we can align the block ourselves.
+	size_t size = rjm_raytreememsize(tree->triCount);
+	void *mem = RJM_RAYTRACE_MALLOC(size + RJM_RAYTREE_ALIGN-1, RJM_RAYALLOC_TREE, tree->allocUser);
+	if (!mem)
+	{
+		tree->mem = NULL;
+		rjm_freeraytree(tree);
+		return;
+	}
+	uintptr_t aligned = ((uintptr_t)mem + RJM_RAYTREE_ALIGN-1) & ~(uintptr_t)(RJM_RAYTREE_ALIGN-1);
+	rjm_buildraytreemem(tree, (void *)aligned);
+	tree->mem = mem;
 }
 
 void rjm_freeraytree(RjmRayTree *tree)
 {
-	free(tree->nodes);
-	free(tree->leafs);
-	free(tree->leafTris);
+	if (tree->mem)
+		RJM_RAYTRACE_FREE(tree->mem, RJM_RAYALLOC_TREE, tree->allocUser);
+	tree->mem = NULL;
 	tree->nodes = NULL;
 	tree->leafs = NULL;
 	tree->leafTris = NULL;
-	tree->firstLeaf = -1;
+	tree->nodeCount = 0;
+	tree->leafCount = 0;
 }
 
-void rjm_raytrace(RjmRayTree *tree, int nrays, RjmRay *rays, float cutoff, RjmRayFilterFn *filter, void *userdata)
+int rjm_raytree_numanodes(void)
 {
-	// Allocate local SSE structures.
-	RJM_RT_ALIGN float rx[RJM_PACKET_SIZE], ry[RJM_PACKET_SIZE], rz[RJM_PACKET_SIZE];
-	RJM_RT_ALIGN float dx[RJM_PACKET_SIZE], dy[RJM_PACKET_SIZE], dz[RJM_PACKET_SIZE];
-	RJM_RT_ALIGN float ix[RJM_PACKET_SIZE], iy[RJM_PACKET_SIZE], iz[RJM_PACKET_SIZE];
-	RJM_RT_ALIGN float maxt[RJM_PACKET_SIZE];
-	RJM_RT_ALIGN int rayidx[RJM_PACKET_SIZE];
+#if RJM_RT_NUMA
+	if (numa_available() >= 0)
+		return numa_max_node() + 1;
+#endif
+	return 1;
+}
 
-	RJM_RT_ALIGN int32_t out_mask[RJM_PACKET_SIZE];
-	RJM_RT_ALIGN float out_u[RJM_PACKET_SIZE], out_v[RJM_PACKET_SIZE], out_t[RJM_PACKET_SIZE];
+int rjm_raytree_numanode(void)
+{
+#if RJM_RT_NUMA
+	if (numa_available() >= 0) {
+		int cpu = sched_getcpu();
+		int node = (cpu >= 0) ? numa_node_of_cpu(cpu) : -1;
+		if (node >= 0)
+			return node;
+	}
+#endif
+	return 0;
+}
 
-	int stack[64], *top;
+int rjm_raytree_bindthread(int numaNode)
+{
+#if RJM_RT_NUMA
+	if (numa_available() >= 0)
+		return numa_run_on_node(numaNode);
+#else
+	(void)numaNode;
+#endif
+	return 0;
+}
 
-	// Process it in packets, in case they pass in a lot of rays at once.
-	for (int base=0;base<nrays;)
+void rjm_replicateraytree(RjmRayTree *dst, const RjmRayTree *src, int numaNode)
+{
+	// We don't know the vertex count, so find the highest one used.
+	int vtxCount = 0;
+	for (int n=0;n<src->triCount*3;n++)
+		if (src->tris[n] >= vtxCount)
+			vtxCount = src->tris[n] + 1;
+
+	// Tree arrays first (same layout as the source), then the scene.
+	size_t treeBytes = rjm_raytree_roundup(rjm_raytreememsize(src->triCount));
+	size_t vtxBytes = rjm_raytree_roundup(vtxCount * 3 * sizeof(float));
+	size_t triBytes = src->triCount * 3 * sizeof(int);
+	size_t size = treeBytes + vtxBytes + triBytes;
+
+	// Page-align the block, and pad it to whole pages, so that placement
+	// covers all of it without touching anything outside the allocation.
+	size_t align = RJM_RAYTREE_ALIGN;
+#if RJM_RT_NUMA
+	int numa = numa_available() >= 0;
+	if (numa && (size_t)numa_pagesize() > align)
+		align = numa_pagesize();
+#endif
+	size = (size + align-1) & ~(align-1);
+	*dst = *src;
+	void *mem = RJM_RAYTRACE_MALLOC(size + align-1, RJM_RAYALLOC_TREE, src->allocUser);
+	if (!mem)
 	{
-		int npacket = nrays - base;
-		if (npacket > RJM_PACKET_SIZE)
-			npacket = RJM_PACKET_SIZE;
-		int next = base + npacket;
-		RjmRay *raybatch = rays + base;
+		dst->mem = NULL;
+		rjm_freeraytree(dst);
+		return;
+	}
+	char *ptr = (char *)(((uintptr_t)mem + align-1) & ~(uintptr_t)(align-1));
+#if RJM_RT_NUMA
+	// The block may reuse heap pages that are already faulted in
+	// elsewhere, so move those as well as setting the policy for the
+	// rest. (the copy below faults in any that aren't)
+	if (numa)
+	{
+		struct bitmask *nodes = numa_allocate_nodemask();
+		numa_bitmask_setbit(nodes, numaNode);
+		mbind(ptr, size, MPOL_BIND, nodes->maskp, nodes->size + 1, MPOL_MF_MOVE);
+		numa_free_nodemask(nodes);
+	}
+#else
+	(void)numaNode;
+#endif
 
-		// Copy rays into our local structure.
-		for (int n=0;n<npacket;n++)
-		{
-			rx[n] = raybatch[n].org[0];
-			ry[n] = raybatch[n].org[1];
-			rz[n] = raybatch[n].org[2];
-			dx[n] = raybatch[n].dir[0];
-			dy[n] = raybatch[n].dir[1];
-			dz[n] = raybatch[n].dir[2];
-			ix[n] = 1.0f / raybatch[n].dir[0]; // relies on IEEE infinity
-			iy[n] = 1.0f / raybatch[n].dir[1];
-			iz[n] = 1.0f / raybatch[n].dir[2];
-			maxt[n] = raybatch[n].t;
+	dst->mem = mem;
+	dst->nodes = (RjmRayNode *)ptr;
+	dst->leafs = (RjmRayLeaf *)(ptr + ((char *)src->leafs - (char *)src->nodes));
+	dst->leafTris = (int *)(ptr + ((char *)src->leafTris - (char *)src->nodes));
+	dst->vtxs = (float *)(ptr + treeBytes);
+	dst->tris = (int *)(ptr + treeBytes + vtxBytes);
+	memcpy(ptr, src->nodes, rjm_raytreememsize(src->triCount));
+	memcpy(dst->vtxs, src->vtxs, vtxCount * 3 * sizeof(float));
+	memcpy(dst->tris, src->tris, triBytes);
+}
 
-			raybatch[n].visibility = 1.0f;
-			raybatch[n].hit = -1;
-			raybatch[n].u = 0;
-			raybatch[n].v = 0;
-			rayidx[n] = base + n;
-		}
+static float rjm_raynode_area(const RjmRayNode *node)
+{
+	float dx = node->bmax[0] - node->bmin[0];
+	float dy = node->bmax[1] - node->bmin[1];
+	float dz = node->bmax[2] - node->bmin[2];
+	return 2.0f * (dx*dy + dy*dz + dz*dx);
+}
 
-		// Align up to multiple of 4.
-		while (npacket & 3) {
-			int d = npacket, s = npacket-1;
-			rx[d] = rx[s]; ry[d] = ry[s]; rz[d] = rz[s];
-			dx[d] = dx[s]; dy[d] = dy[s]; dz[d] = dz[s];
-			ix[d] = ix[s]; iy[d] = iy[s]; iz[d] = iz[s];
-			maxt[d] = maxt[s];
-			rayidx[d] = -1;
-			npacket++;
-		}
+static void rjm_raytreeinfo_node(const RjmRayTree *tree, RjmRayTreeInfo *info, int nodeIdx, int depth)
+{
+	// Every node's box gets tested when its parent's box is hit.
+	const RjmRayNode *node = tree->nodes + nodeIdx;
+	float area = rjm_raynode_area(node);
+	info->sahCost += area * RJM_SAH_NODE_COST;
+
+	if (RJM_RT_ISLEAF(node->child)) {
+		// Leaf triangles get tested whenever the leaf's box is hit.
+		const RjmRayLeaf *leaf = tree->leafs + RJM_RT_LEAF(node->child);
+		info->leafFill[leaf->triCount]++;
+		info->sahCost += area * leaf->triCount;
+		if (depth > info->depth)
+			info->depth = depth;
+		return;
+	}
 
-		// Push terminator.
-		top = stack;
-		*top++ = 0;
-		*top++ = 0;
+	rjm_raytreeinfo_node(tree, info, node->child, depth+1);
+	rjm_raytreeinfo_node(tree, info, node->child+1, depth+1);
+}
 
-		int nodeIdx = 0;
-		int ncur = npacket;
+void rjm_raytreeinfo(const RjmRayTree *tree, RjmRayTreeInfo *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->nodeCount = tree->nodeCount;
+	info->leafCount = tree->leafCount;
+	info->nodeBytes = rjm_raytree_nodeslots(tree->leafCount) * sizeof(RjmRayNode);
+	info->leafBytes = info->leafCount * sizeof(RjmRayLeaf);
+	info->leafTriBytes = tree->triCount * sizeof(int);
+	info->totalBytes = info->nodeBytes + info->leafBytes + info->leafTriBytes;
+
+	// Costs are accumulated as raw areas, then made relative to the root.
+	float rootArea = rjm_raynode_area(tree->nodes);
+	rjm_raytreeinfo_node(tree, info, 0, 0);
+	if (rootArea > 0)
+		info->sahCost /= rootArea;
+}
 
-		// Trace the tree.
-		do {
-			int nvec = ncur >> 2;
+void rjm_raytrace(RjmRayTree *tree, int nrays, RjmRay *rays, float cutoff, RjmRayFilterFn *filter, void *userdata)
+{
+	// Pick a specialized traversal, so the per-hit mode/filter
+	// checks get compiled out.
+#ifdef __cplusplus
+#define RJM_RT_TRACE(MODE, FILTER)	rjm_raytracet<MODE, RJM_PACKET_SIZE>(tree, nrays, rays, cutoff, FILTER)
+#define RJM_RT_NOFILTER				RjmNoFilter()
+#else
+#define RJM_RT_TRACE(MODE, FILTER)	rjm_raytrace_core(tree, nrays, rays, cutoff, FILTER, MODE)
+#define RJM_RT_NOFILTER				(RjmRayFilterC){ NULL, NULL }
+#endif
+	RjmRayFilterC fn = { filter, userdata };
+	if (cutoff < 0) {
+		if (filter)	RJM_RT_TRACE(RJM_RAYMODE_FIRSTHIT, fn);
+		else		RJM_RT_TRACE(RJM_RAYMODE_FIRSTHIT, RJM_RT_NOFILTER);
+	} else {
+		if (filter)	RJM_RT_TRACE(RJM_RAYMODE_VISIBILITY, fn);
+		else		RJM_RT_TRACE(RJM_RAYMODE_VISIBILITY, RJM_RT_NOFILTER);
+	}
+#undef RJM_RT_TRACE
+#undef RJM_RT_NOFILTER
+}
 
-			int leafIdx = nodeIdx - tree->firstLeaf;
-			if (leafIdx >= 0)
-			{
-				// Leaf, test each triangle.
-				RjmRayLeaf *leaf = tree->leafs + leafIdx;
-				int *idxs = tree->leafTris + leaf->triIndex;
-				int triCount = leaf->triCount;
-				while (triCount--)
-				{
-					// Read triangle data.
-					int triIdx = *idxs++;
-					int *tri = tree->tris + triIdx*3;
-					float *v0 = tree->vtxs + tri[0]*3;
-					float *v1 = tree->vtxs + tri[1]*3;
-					float *v2 = tree->vtxs + tri[2]*3;
-
-					// Edge vector.
-					__m128 e01x = _mm_set1_ps(v1[0] - v0[0]);
-					__m128 e01y = _mm_set1_ps(v1[1] - v0[1]);
-					__m128 e01z = _mm_set1_ps(v1[2] - v0[2]);
-					__m128 e02x = _mm_set1_ps(v2[0] - v0[0]);
-					__m128 e02y = _mm_set1_ps(v2[1] - v0[1]);
-					__m128 e02z = _mm_set1_ps(v2[2] - v0[2]);
-
-					// Ray-triangle intersection.
-					__m128 mask = _mm_setzero_ps();
-					for (int n=0;n<nvec;n++)
-					{
-						int p = n*4;
-
-						// pvec = cross(dir, e02)
-						__m128 pvecx = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(dy+p), e02z), _mm_mul_ps(_mm_load_ps(dz+p), e02y));
-						__m128 pvecy = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(dz+p), e02x), _mm_mul_ps(_mm_load_ps(dx+p), e02z));
-						__m128 pvecz = _mm_sub_ps(_mm_mul_ps(_mm_load_ps(dx+p), e02y), _mm_mul_ps(_mm_load_ps(dy+p), e02x));
-
-						// det = dot(e01, pvec)
-						__m128 det = _mm_add_ps(_mm_mul_ps(e01x, pvecx), _mm_add_ps(_mm_mul_ps(e01y, pvecy), _mm_mul_ps(e01z, pvecz)));
-						
-						// tvec = org - vtx0
-						__m128 tvecx = _mm_sub_ps(_mm_load_ps(rx+p), _mm_set_ps1(v0[0]));
-						__m128 tvecy = _mm_sub_ps(_mm_load_ps(ry+p), _mm_set_ps1(v0[1]));
-						__m128 tvecz = _mm_sub_ps(_mm_load_ps(rz+p), _mm_set_ps1(v0[2]));
-
-						// qvec = cross(tvec, e01)
-						__m128 qvecx = _mm_sub_ps(_mm_mul_ps(tvecy, e01z), _mm_mul_ps(tvecz, e01y));
-						__m128 qvecy = _mm_sub_ps(_mm_mul_ps(tvecz, e01x), _mm_mul_ps(tvecx, e01z));
-						__m128 qvecz = _mm_sub_ps(_mm_mul_ps(tvecx, e01y), _mm_mul_ps(tvecy, e01x));
-
-						// u = dot(tvec, pvec) * inv_det
-						// v = dot(dir, qvec) * inv_det
-						// t = dot(e02, qvec) * inv_det
-						__m128 u = _mm_add_ps(_mm_mul_ps(tvecx, pvecx), _mm_add_ps(_mm_mul_ps(tvecy, pvecy), _mm_mul_ps(tvecz, pvecz)));
-						__m128 v = _mm_add_ps(_mm_mul_ps(_mm_load_ps(dx+p), qvecx), _mm_add_ps(_mm_mul_ps(_mm_load_ps(dy+p), qvecy), _mm_mul_ps(_mm_load_ps(dz+p), qvecz)));
-						__m128 t = _mm_add_ps(_mm_mul_ps(e02x, qvecx), _mm_add_ps(_mm_mul_ps(e02y, qvecy), _mm_mul_ps(e02z, qvecz)));
-						__m128 inv_det = _mm_div_ps(_mm_set_ps1(1.0f), det);
-						u = _mm_mul_ps(u, inv_det);
-						v = _mm_mul_ps(v, inv_det);
-						t = _mm_mul_ps(t, inv_det);
-
-						// Intersection if all of:
-						// u>=0, u<=1, v>=0, u+v<=1, t>=0, t<=maxt
-						__m128 zero = _mm_setzero_ps();
-						__m128 one = _mm_set_ps1(1.0f);
-						__m128 prev = _mm_load_ps(maxt+p);
-						__m128 isect = _mm_cmpge_ps(u, zero);
-						isect = _mm_and_ps(isect, _mm_cmple_ps(u, one));
-						isect = _mm_and_ps(isect, _mm_cmpge_ps(v, zero));
-						isect = _mm_and_ps(isect, _mm_cmple_ps(_mm_add_ps(u,v), one));
-						isect = _mm_and_ps(isect, _mm_cmpge_ps(t, zero));
-						isect = _mm_and_ps(isect, _mm_cmple_ps(t, prev));
-
-						mask = _mm_or_ps(mask, isect);
-						_mm_store_ps((float *)out_mask + p, isect);
-						_mm_store_ps((float *)out_u + p, u);
-						_mm_store_ps((float *)out_v + p, v);
-						_mm_store_ps((float *)out_t + p, t);
-					}
+int rjm_sortrayhits(const RjmRayTree *tree, int nrays, const RjmRay *rays, const int *keys, int nkeys, int *order, int *scratch)
+{
+	// Counting sort, with misses in the last bucket.
+	if (!keys)
+		nkeys = tree->triCount;
+	int *start = scratch ? scratch : (int *)RJM_RAYTRACE_MALLOC((nkeys+1) * sizeof(int), RJM_RAYALLOC_SCRATCH, tree->allocUser);
+	if (!start)
+		return -1;
+	memset(start, 0, (nkeys+1) * sizeof(int));
+
+	for (int n=0;n<nrays;n++)
+	{
+		int hit = rays[n].hit;
+		int key = (hit < 0) ? nkeys : keys ? keys[hit] : hit;
+		start[key]++;
+	}
 
-					// See which ones hit.
-					if (_mm_movemask_ps(mask) != 0)
-					{
-						for (int n=0;n<ncur;n++)
-						{
-							if (out_mask[n] < 0 && rayidx[n] >= 0)
-							{
-								RjmRay *ray = rays + rayidx[n];
-								if (out_t[n] < ray->t) {
-									float opacity = 1.0f;
-									if (filter)
-										opacity = filter(triIdx, rayidx[n], out_t[n], out_u[n], out_v[n], userdata);
-									if (cutoff >= 0)
-									{
-										// Shadow mode, accumulate total visibility.
-										ray->visibility *= (1-opacity);
-										if (ray->visibility <= cutoff)
-											maxt[n] = 0; // stop further testing
-									} else {
-										// Regular mode, find earliest intersection.
-										if (opacity >= 0.5f)
-										{
-											ray->t = out_t[n];
-											ray->u = out_u[n];
-											ray->v = out_v[n];
-											ray->hit = triIdx;
-											ray->visibility = 0.0f;
-											maxt[n] = out_t[n];
-										}
-									}
-								}
-							}
-						}
-					}
-				}
-			} else {
-				// Node, test bounds.
-				RjmRayNode *node = tree->nodes + nodeIdx;
-				__m128 bminx = _mm_set_ps1(node->bmin[0]);
-				__m128 bminy = _mm_set_ps1(node->bmin[1]);
-				__m128 bminz = _mm_set_ps1(node->bmin[2]);
-				__m128 bmaxx = _mm_set_ps1(node->bmax[0]);
-				__m128 bmaxy = _mm_set_ps1(node->bmax[1]);
-				__m128 bmaxz = _mm_set_ps1(node->bmax[2]);
-
-				__m128 mask = _mm_setzero_ps();
-
-				// Ray-box slab test.
-				for (int n=0;n<nvec;n++) {
-					int p = n*4;
-					// d0 = (bmin - org) * invdir
-					// d1 = (bmax - org) * invdir
-					__m128 d0x = _mm_mul_ps(_mm_sub_ps(bminx, _mm_load_ps(rx+p)), _mm_load_ps(ix+p));
-					__m128 d0y = _mm_mul_ps(_mm_sub_ps(bminy, _mm_load_ps(ry+p)), _mm_load_ps(iy+p));
-					__m128 d0z = _mm_mul_ps(_mm_sub_ps(bminz, _mm_load_ps(rz+p)), _mm_load_ps(iz+p));
-					__m128 d1x = _mm_mul_ps(_mm_sub_ps(bmaxx, _mm_load_ps(rx+p)), _mm_load_ps(ix+p));
-					__m128 d1y = _mm_mul_ps(_mm_sub_ps(bmaxy, _mm_load_ps(ry+p)), _mm_load_ps(iy+p));
-					__m128 d1z = _mm_mul_ps(_mm_sub_ps(bmaxz, _mm_load_ps(rz+p)), _mm_load_ps(iz+p));
-
-					// v0 = min(d0, d1)
-					// v1 = max(d0, d1)
-					__m128 v0x = _mm_min_ps(d0x, d1x);
-					__m128 v0y = _mm_min_ps(d0y, d1y);
-					__m128 v0z = _mm_min_ps(d0z, d1z);
-					__m128 v1x = _mm_max_ps(d0x, d1x);
-					__m128 v1y = _mm_max_ps(d0y, d1y);
-					__m128 v1z = _mm_max_ps(d0z, d1z);
-
-					// tmin = hmax(v0)
-					// tmax = hmin(v1)
-					__m128 tmin = _mm_max_ps(v0x, _mm_max_ps(v0y, v0z));
-					__m128 tmax = _mm_min_ps(v1x, _mm_min_ps(v1y, v1z));
-
-					__m128 prevt = _mm_load_ps(maxt+p);
-
-					// hit if: (tmax >= 0) && (tmax >= tmin) && (tmin <= maxt)
-					__m128 isect = _mm_cmpge_ps(tmax, _mm_setzero_ps());
-					isect = _mm_and_ps(isect, _mm_cmpge_ps(tmax, tmin));
-					isect = _mm_and_ps(isect, _mm_cmple_ps(tmin, prevt));
-
-					mask = _mm_or_ps(mask, isect); // accumulate results
-					_mm_store_ps((float *)out_mask + p, isect);
-				}
+	// Turn the counts into bucket offsets.
+	int total = 0;
+	for (int k=0;k<=nkeys;k++)
+	{
+		int count = start[k];
+		start[k] = total;
+		total += count;
+	}
+	int nhit = start[nkeys];
 
-				// Check if any rays hit the box.
-				if (_mm_movemask_ps(mask) != 0)
-				{
-					// Re-order rays into ones that hit and ones that didn't.
-					int nhit = 0;
-					while (nhit < ncur)
-					{
-						if (out_mask[nhit] >= 0) {
-							// miss, move ray to the end
-							int d = nhit, s = --ncur;
-							RJM_RT_SWAP(float, rx[d], rx[s]);
-							RJM_RT_SWAP(float, ry[d], ry[s]);
-							RJM_RT_SWAP(float, rz[d], rz[s]);
-							RJM_RT_SWAP(float, dx[d], dx[s]);
-							RJM_RT_SWAP(float, dy[d], dy[s]);
-							RJM_RT_SWAP(float, dz[d], dz[s]);
-							RJM_RT_SWAP(float, ix[d], ix[s]);
-							RJM_RT_SWAP(float, iy[d], iy[s]);
-							RJM_RT_SWAP(float, iz[d], iz[s]);
-							RJM_RT_SWAP(float, maxt[d], maxt[s]);
-							RJM_RT_SWAP(int, rayidx[d], rayidx[s]);
-							RJM_RT_SWAP(int, out_mask[d], out_mask[s]);
-						} else {
-							// hit
-							nhit++;
-						}
-					}
+	for (int n=0;n<nrays;n++)
+	{
+		int hit = rays[n].hit;
+		int key = (hit < 0) ? nkeys : keys ? keys[hit] : hit;
+		order[start[key]++] = n;
+	}
 
-					if (ncur > 0) {
-						ncur = (ncur + 3) & ~3;
+	if (!scratch)
+		RJM_RAYTRACE_FREE(start, RJM_RAYALLOC_SCRATCH, tree->allocUser);
+	return nhit;
+}
 
-						// Recurse in with only the rays that hit the node.
-						*top++ = nodeIdx*2+2;
-						*top++ = ncur;
-						nodeIdx = nodeIdx*2+1;
-						continue;
-					}
-				}
-			}
+// Wall-clock time in seconds, for rjm_traceprogress.
+// (falls back to CPU time if there's no monotonic clock available)
+static double rjm_raytrace_seconds(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
 
-			// Pull a new node off the stack.
-			ncur = *--top;
-			nodeIdx = *--top;
-		} while (nodeIdx);
+int rjm_initrayprogress(RjmRayProgress *prog)
+{
+	size_t sumBytes = rjm_raytree_roundup(prog->groupCount * sizeof(float));
+	prog->allocUser = prog->tree->allocUser;
+	char *mem = (char *)RJM_RAYTRACE_MALLOC(sumBytes + RJM_RAYPROGRESS_BATCH * sizeof(RjmRay), RJM_RAYALLOC_SCRATCH, prog->allocUser);
+	prog->sum = (float *)mem;
+	prog->rays = mem ? (RjmRay *)(mem + sumBytes) : NULL;
+	prog->rayTime = 0;
+	rjm_resetrayprogress(prog);
+	return mem != NULL;
+}
 
-		base = next;
+void rjm_resetrayprogress(RjmRayProgress *prog)
+{
+	if (prog->sum)
+		memset(prog->sum, 0, prog->groupCount * sizeof(float));
+	prog->pass = 0;
+	prog->next = 0;
+}
+
+void rjm_freerayprogress(RjmRayProgress *prog)
+{
+	RJM_RAYTRACE_FREE(prog->sum, RJM_RAYALLOC_SCRATCH, prog->allocUser);
+	prog->sum = NULL;
+	prog->rays = NULL;
+}
+
+int rjm_traceprogress(RjmRayProgress *prog, double seconds, int maxRays)
+{
+	double start = rjm_raytrace_seconds(), now = start;
+	int traced = 0;
+
+	while (prog->sum && prog->groupCount > 0 && (prog->sampleCount <= 0 || prog->pass < prog->sampleCount))
+	{
+		// Batches stay within one pass, so every ray in it is the same sample.
+		int count = prog->groupCount - prog->next;
+		if (count > RJM_RAYPROGRESS_BATCH)
+			count = RJM_RAYPROGRESS_BATCH;
+		if (maxRays > 0 && count > maxRays - traced)
+			count = maxRays - traced;
+
+		// Shrink the batch to whole packets that fit in the time left.
+		if (seconds > 0 && prog->rayTime > 0)
+		{
+			double fit = (seconds - (now - start)) / prog->rayTime;
+			if (fit < count)
+			{
+				int packets = (int)fit / RJM_PACKET_SIZE;
+				count = packets * RJM_PACKET_SIZE;
+			}
+		}
+		if (traced == 0 && count < RJM_PACKET_SIZE)
+		{
+			count = prog->groupCount - prog->next;
+			if (count > RJM_PACKET_SIZE)
+				count = RJM_PACKET_SIZE;
+			if (maxRays > 0 && count > maxRays)
+				count = maxRays;
+		}
+		if (count <= 0)
+			break;
+
+		int first = prog->next;
+		prog->gen(first, count, prog->pass, prog->rays, prog->userdata);
+		rjm_raytrace(prog->tree, count, prog->rays, prog->cutoff, prog->filter, prog->userdata);
+		for (int n=0;n<count;n++)
+			prog->sum[first+n] += prog->rays[n].visibility;
+
+		prog->next += count;
+		int endPass = prog->next == prog->groupCount;
+		if (endPass)
+		{
+			prog->next = 0;
+			prog->pass++;
+		}
+		traced += count;
+
+		// Keep a running estimate of the trace speed, for sizing the
+		// next batch. (this includes the time spent generating rays)
+		double prev = now;
+		now = rjm_raytrace_seconds();
+		double rayTime = (now - prev) / count;
+		if (prog->rayTime > 0)
+			prog->rayTime = prog->rayTime * 0.75 + rayTime * 0.25;
+		else
+			prog->rayTime = rayTime;
+
+		if (seconds > 0 && now - start >= seconds)
+			break;
+		if (maxRays > 0 && traced >= maxRays)
+			break;
+		if (seconds <= 0 && maxRays <= 0 && prog->sampleCount <= 0 && endPass)
+			break;
 	}
+
+	return traced;
+}
+
+int rjm_rayprogress_samples(const RjmRayProgress *prog, int group)
+{
+	return (group < prog->next) ? prog->pass+1 : prog->pass;
+}
+
+float rjm_rayprogress_result(const RjmRayProgress *prog, int group)
+{
+	int samples = rjm_rayprogress_samples(prog, group);
+	return samples ? prog->sum[group] / samples : 1.0f;
 }
 
+#ifdef RJM_RAYTRACE_STATS
+void rjm_raytracestats(RjmRayStats *stats)
+{
+	*stats = rjm_raytrace_laststats;
+}
+
+void rjm_raytrace_storestats(const RjmRayStats *stats)
+{
+	rjm_raytrace_laststats = *stats;
+}
+#endif
+
 #endif // RJM_RAYTRACE_IMPLEMENTATION
 #endif // __RJM_RAYTRACE_H__